@@ -0,0 +1,24 @@
+#include "Deadlines.h"
+
+uint32_t findNextDeadline(uint32_t now, const Deadline *deadlines, int count, uint32_t maxWait)
+{
+  uint32_t wait = maxWait;
+  for (int i = 0; i < count; i++)
+  {
+    if (!deadlines[i].active)
+    {
+      continue;
+    }
+    uint32_t elapsed = now - deadlines[i].start;
+    if (elapsed >= deadlines[i].interval)
+    {
+      return 0;
+    }
+    uint32_t remaining = deadlines[i].interval - elapsed;
+    if (remaining < wait)
+    {
+      wait = remaining;
+    }
+  }
+  return wait;
+}
@@ -0,0 +1,18 @@
+#ifndef DEADLINES_H
+#define DEADLINES_H
+
+#include <stdint.h>
+
+// Periodic job of the main loop: due interval milliseconds after start
+struct Deadline
+{
+  bool active;
+  uint32_t start;
+  uint32_t interval;
+};
+
+// Milliseconds until the first active job is due (0 if one already is), at most maxWait.
+// Times are millis() values: the unsigned math stays correct when millis() wraps around (49.7 days).
+uint32_t findNextDeadline(uint32_t now, const Deadline *deadlines, int count, uint32_t maxWait);
+
+#endif
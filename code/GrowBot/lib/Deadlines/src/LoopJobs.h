@@ -0,0 +1,19 @@
+#ifndef LOOP_JOBS_H
+#define LOOP_JOBS_H
+
+// Periods of the timed jobs of the firmware loop in milliseconds - shared with the host tests of the idle deadline
+
+// Number of milliseconds in one hour (hour tick)
+#define ONE_HOUR 3600000
+// Milliseconds before polling again after a failed poll (and between the short polls of the library path)
+#define BOT_POLL_INTERVAL 3000
+// Period in milliseconds between two history samples (15 minutes)
+#define HISTORY_PERIOD 900000
+// Period of the rule clock: rules with a time of day are evaluated at each minute
+#define RULE_CLOCK_PERIOD 60000
+// Milliseconds between two connection attempts of a firmware download
+#define OTA_RETRY_INTERVAL 10000
+// Longest idle wait in milliseconds - the idle stage feeds the watchdog at least this often
+#define MAX_IDLE_TIME 30000
+
+#endif
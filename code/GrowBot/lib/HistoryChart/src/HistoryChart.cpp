@@ -0,0 +1,244 @@
+#include "HistoryChart.h"
+
+#include <string.h>
+
+const uint8_t chartPalette[COLOR_COUNT * 3] = {
+    24, 24, 24,   // COLOR_BACKGROUND
+    70, 70, 70,   // COLOR_GRID
+    40, 40, 40,   // COLOR_LANE
+    255, 200, 0,  // COLOR_LED
+    255, 255, 255, // COLOR_FS
+    0, 200, 255,  // COLOR_VENTILATION
+    40, 90, 255,  // COLOR_PUMP
+    255, 60, 60,  // COLOR_TEMPERATURE
+    60, 220, 90,  // COLOR_SOIL
+};
+
+//-----------------------
+
+void beginChart(ChartEncoder &encoder, HistorySource source, int hours, int periodsPerHour)
+{
+  encoder.source = source;
+  encoder.hours = hours;
+  encoder.periods = hours * periodsPerHour;
+  encoder.part = PART_HEADER;
+  encoder.length = 0;
+  encoder.position = 0;
+}
+
+//-----------------------
+
+int getChartFileSize()
+{
+  // signature + IHDR + PLTE + IDAT (zlib header, stored block header, rows, adler32) + IEND
+  return 8 + (12 + 13) + (12 + COLOR_COUNT * 3) + (12 + 2 + 5 + CHART_RAW_SIZE + 4) + 12;
+}
+
+//-----------------------
+
+void encodeNextChartPart(ChartEncoder &encoder)
+{
+  static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  static_assert(CHART_RAW_SIZE <= 65535, "the chart must fit a single stored deflate block");
+
+  encoder.length = 0;
+  encoder.position = 0;
+
+  switch (encoder.part)
+  {
+  case PART_HEADER:
+  {
+    memcpy(encoder.buffer, signature, sizeof(signature));
+    encoder.length = sizeof(signature);
+
+    // IHDR: width, height, 4 bits per pixel, palette, deflate, no filter, no interlace
+    appendChartUint32(encoder, 13);
+    int crcStart = encoder.length;
+    memcpy(encoder.buffer + encoder.length, "IHDR", 4);
+    encoder.length += 4;
+    appendChartUint32(encoder, CHART_WIDTH);
+    appendChartUint32(encoder, CHART_HEIGHT);
+    const uint8_t format[5] = {4, 3, 0, 0, 0};
+    memcpy(encoder.buffer + encoder.length, format, sizeof(format));
+    encoder.length += sizeof(format);
+    appendChartUint32(encoder, updateCrc(0, encoder.buffer + crcStart, encoder.length - crcStart));
+
+    // PLTE
+    appendChartUint32(encoder, sizeof(chartPalette));
+    crcStart = encoder.length;
+    memcpy(encoder.buffer + encoder.length, "PLTE", 4);
+    encoder.length += 4;
+    memcpy(encoder.buffer + encoder.length, chartPalette, sizeof(chartPalette));
+    encoder.length += sizeof(chartPalette);
+    appendChartUint32(encoder, updateCrc(0, encoder.buffer + crcStart, encoder.length - crcStart));
+
+    // IDAT: zlib header (no compression) and one final stored block with all the rows
+    appendChartUint32(encoder, 2 + 5 + CHART_RAW_SIZE + 4);
+    crcStart = encoder.length;
+    const uint8_t idatHeader[11] = {'I', 'D', 'A', 'T', 0x78, 0x01, 0x01, CHART_RAW_SIZE & 0xFF, CHART_RAW_SIZE >> 8,
+                                    (uint8_t)(~CHART_RAW_SIZE & 0xFF), (uint8_t)((~CHART_RAW_SIZE >> 8) & 0xFF)};
+    memcpy(encoder.buffer + encoder.length, idatHeader, sizeof(idatHeader));
+    encoder.length += sizeof(idatHeader);
+    encoder.crc = updateCrc(0, encoder.buffer + crcStart, encoder.length - crcStart);
+    encoder.adlerA = 1;
+    encoder.adlerB = 0;
+
+    encoder.row = 0;
+    encoder.part = PART_ROWS;
+    break;
+  }
+  case PART_ROWS:
+  {
+    // Filter type 0 (none) and the palette indexes of the row
+    encoder.buffer[0] = 0;
+    renderChartRow(encoder, encoder.row, encoder.buffer + 1);
+    encoder.length = CHART_ROW_BYTES;
+
+    encoder.crc = updateCrc(encoder.crc, encoder.buffer, encoder.length);
+    for (int i = 0; i < encoder.length; i++)
+    {
+      encoder.adlerA = (encoder.adlerA + encoder.buffer[i]) % 65521;
+      encoder.adlerB = (encoder.adlerB + encoder.adlerA) % 65521;
+    }
+
+    encoder.row++;
+    if (encoder.row >= CHART_HEIGHT)
+    {
+      encoder.part = PART_TRAILER;
+    }
+    break;
+  }
+  case PART_TRAILER:
+  {
+    appendChartUint32(encoder, (encoder.adlerB << 16) | encoder.adlerA);
+    appendChartUint32(encoder, updateCrc(encoder.crc, encoder.buffer, 4));
+
+    // IEND
+    const uint8_t iend[12] = {0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xAE, 0x42, 0x60, 0x82};
+    memcpy(encoder.buffer + encoder.length, iend, sizeof(iend));
+    encoder.length += sizeof(iend);
+    encoder.part = PART_DONE;
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+//-----------------------
+
+void renderChartRow(const ChartEncoder &encoder, int row, uint8_t *pixels)
+{
+  for (int x = 0; x < CHART_WIDTH; x += 2)
+  {
+    pixels[x / 2] = (getChartPixel(encoder, x, row) << 4) | getChartPixel(encoder, x + 1, row);
+  }
+}
+
+//-----------------------
+
+uint8_t getChartPixel(const ChartEncoder &encoder, int x, int row)
+{
+  // Vertical grid line where the column crosses a multiple of 6 hours
+  int hours = encoder.hours;
+  bool grid = x > 0 && ((CHART_WIDTH - 1 - x) * hours / CHART_WIDTH) / 6 != ((CHART_WIDTH - x) * hours / CHART_WIDTH) / 6;
+
+  HistorySample sample;
+  bool hasSample = getChartSample(encoder, x, sample);
+
+  if (row >= CHART_SENSOR_TOP && row < CHART_SENSOR_TOP + CHART_SENSOR_HEIGHT)
+  {
+    if (hasSample)
+    {
+      // Line from the previous column value to this one, so steps stay connected
+      HistorySample previous;
+      bool hasPrevious = x > 0 && getChartSample(encoder, x - 1, previous);
+      const uint8_t flags[2] = {HISTORY_TEMPERATURE, HISTORY_SOIL};
+      const uint8_t colors[2] = {COLOR_TEMPERATURE, COLOR_SOIL};
+      for (int i = 0; i < 2; i++)
+      {
+        int current = getSensorRow(sample, flags[i]);
+        int last = hasPrevious ? getSensorRow(previous, flags[i]) : -1;
+        if (last < 0)
+        {
+          last = current;
+        }
+        if (current >= 0 && row >= (current < last ? current : last) && row <= (current > last ? current : last))
+        {
+          return colors[i];
+        }
+      }
+    }
+    return grid ? COLOR_GRID : COLOR_BACKGROUND;
+  }
+
+  uint8_t laneColor = COLOR_BACKGROUND;
+  if (row >= CHART_LIGHT_TOP && row < CHART_LIGHT_TOP + CHART_LANE_HEIGHT)
+  {
+    laneColor = !hasSample || (sample.flags & HISTORY_LED) == 0 ? COLOR_LANE : (sample.flags & HISTORY_FS) ? COLOR_FS : COLOR_LED;
+  }
+  else if (row >= CHART_VENTILATION_TOP && row < CHART_VENTILATION_TOP + CHART_LANE_HEIGHT)
+  {
+    laneColor = hasSample && (sample.flags & HISTORY_VENTILATION) ? COLOR_VENTILATION : COLOR_LANE;
+  }
+  else if (row >= CHART_PUMP_TOP && row < CHART_PUMP_TOP + CHART_LANE_HEIGHT)
+  {
+    laneColor = hasSample && (sample.flags & HISTORY_PUMP) ? COLOR_PUMP : COLOR_LANE;
+  }
+  else
+  {
+    return grid ? COLOR_GRID : COLOR_BACKGROUND;
+  }
+  return laneColor == COLOR_LANE && grid ? (uint8_t)COLOR_GRID : laneColor;
+}
+
+//-----------------------
+
+int getSensorRow(const HistorySample &sample, uint8_t flag)
+{
+  if ((sample.flags & flag) == 0)
+  {
+    return -1;
+  }
+  int value = sample.soil;
+  if (flag == HISTORY_TEMPERATURE)
+  {
+    int temperature = sample.temperature < 0 ? 0 : sample.temperature > CHART_MAX_TEMPERATURE ? CHART_MAX_TEMPERATURE : sample.temperature;
+    value = temperature * 100 / CHART_MAX_TEMPERATURE;
+  }
+  return CHART_SENSOR_TOP + (CHART_SENSOR_HEIGHT - 1) - value * (CHART_SENSOR_HEIGHT - 1) / 100;
+}
+
+//-----------------------
+
+bool getChartSample(const ChartEncoder &encoder, int x, HistorySample &sample)
+{
+  // The last column is the most recent sample
+  return encoder.source((CHART_WIDTH - 1 - x) * encoder.periods / CHART_WIDTH, sample);
+}
+
+//-----------------------
+
+uint32_t updateCrc(uint32_t crc, const uint8_t *data, int length)
+{
+  // Half-byte table keeps the CRC-32 table at 64 bytes
+  static const uint32_t table[16] = {0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+                                     0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+  crc = ~crc;
+  for (int i = 0; i < length; i++)
+  {
+    crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+    crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+  }
+  return ~crc;
+}
+
+//-----------------------
+
+void appendChartUint32(ChartEncoder &encoder, uint32_t value)
+{
+  encoder.buffer[encoder.length++] = value >> 24;
+  encoder.buffer[encoder.length++] = value >> 16;
+  encoder.buffer[encoder.length++] = value >> 8;
+  encoder.buffer[encoder.length++] = value;
+}
@@ -0,0 +1,113 @@
+#ifndef HISTORY_CHART_H
+#define HISTORY_CHART_H
+
+#include <stdint.h>
+
+// History sample flags - the light bits are the same as the light step mask (LIGHT_LED/LIGHT_FS)
+#define HISTORY_LED 0x01
+#define HISTORY_FS 0x02
+#define HISTORY_VENTILATION 0x04
+#define HISTORY_PUMP 0x08
+#define HISTORY_TEMPERATURE 0x10
+#define HISTORY_SOIL 0x20
+
+// Chart image size in pixels (4 bits per pixel, palette PNG)
+#define CHART_WIDTH 336
+#define CHART_HEIGHT 120
+// Bytes of one PNG scanline: filter byte + 2 pixels per byte
+#define CHART_ROW_BYTES (1 + CHART_WIDTH / 2)
+// Uncompressed image data, sent in a single stored deflate block (must fit 65535 bytes)
+#define CHART_RAW_SIZE (CHART_HEIGHT * CHART_ROW_BYTES)
+// Temperature range of the chart in °C
+#define CHART_MAX_TEMPERATURE 50
+
+// Chart rows: sensor plot on top, then one lane per actuator
+#define CHART_SENSOR_TOP 0
+#define CHART_SENSOR_HEIGHT 64
+#define CHART_LIGHT_TOP 66
+#define CHART_VENTILATION_TOP 84
+#define CHART_PUMP_TOP 102
+#define CHART_LANE_HEIGHT 16
+
+// State of the box in one history period
+struct HistorySample
+{
+  uint8_t flags;
+  int8_t temperature;
+  uint8_t soil;
+};
+
+// Sample of the history, periodsBack periods before the last one. Returns false if there is no such sample.
+typedef bool (*HistorySource)(int periodsBack, HistorySample &sample);
+
+// Chart palette indexes
+enum ChartColor
+{
+  COLOR_BACKGROUND,
+  COLOR_GRID,
+  COLOR_LANE,
+  COLOR_LED,
+  COLOR_FS,
+  COLOR_VENTILATION,
+  COLOR_PUMP,
+  COLOR_TEMPERATURE,
+  COLOR_SOIL,
+  COLOR_COUNT,
+};
+
+// Chart palette (RGB), in the ChartColor order
+extern const uint8_t chartPalette[COLOR_COUNT * 3];
+
+// Parts of the PNG stream
+enum ChartPart
+{
+  PART_HEADER,
+  PART_ROWS,
+  PART_TRAILER,
+  PART_DONE,
+};
+
+// Streaming PNG encoder state - the image is generated one scanline at a time while it is uploaded
+struct ChartEncoder
+{
+  HistorySource source;
+  int hours;
+  int periods;
+  ChartPart part;
+  int row;
+  uint32_t crc;
+  uint32_t adlerA;
+  uint32_t adlerB;
+  uint8_t buffer[CHART_ROW_BYTES + 64];
+  int length;
+  int position;
+};
+
+// Start a chart of the last hours, with periodsPerHour history samples per hour
+void beginChart(ChartEncoder &encoder, HistorySource source, int hours, int periodsPerHour);
+
+// Size in bytes of the chart PNG
+int getChartFileSize();
+
+// Generate the next part of the chart PNG in the encoder buffer
+void encodeNextChartPart(ChartEncoder &encoder);
+
+// Draw one scanline of the chart (after the filter byte)
+void renderChartRow(const ChartEncoder &encoder, int row, uint8_t *pixels);
+
+// Palette index of the chart pixel at a column and row
+uint8_t getChartPixel(const ChartEncoder &encoder, int x, int row);
+
+// Chart row of a sensor value, -1 when the sample has no value
+int getSensorRow(const HistorySample &sample, uint8_t flag);
+
+// Sample of the history shown in a chart column
+bool getChartSample(const ChartEncoder &encoder, int x, HistorySample &sample);
+
+// Update a CRC-32 (PNG chunks) with a buffer
+uint32_t updateCrc(uint32_t crc, const uint8_t *data, int length);
+
+// Append a big-endian 32 bits value to the encoder buffer
+void appendChartUint32(ChartEncoder &encoder, uint32_t value);
+
+#endif
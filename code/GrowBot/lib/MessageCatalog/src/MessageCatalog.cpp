@@ -0,0 +1,262 @@
+#include "MessageCatalog.h"
+
+#include <stdio.h>
+
+// User-facing texts (printf placeholders), one table per locale - const data stays in flash on the ESP32
+static const char *const messageCatalog[LOCALE_COUNT][MSG_COUNT] = {
+    // LOCALE_PT_BR
+    {
+        "Comando %s enviado ha %ld minutos foi ignorado. Envie novamente para executar.",
+        "Comando %s recebido com a GrowBox offline foi ignorado. Envie novamente para executar.",
+        "--- Conexão reestabelecida ---",
+        "--- GrowBox ativa ---",
+        "Luz ligada ha %u horas\nRestam %d para desligar",
+        "Luz desligada ha %u horas\nRestam %d para ligar",
+        "Ultima irrigação realizada ha %u dias e %u horas.",
+        "%d dias e %d horas restantes até a próxima irrigação.",
+        "Luz ligada após %u horas",
+        "Luz desligada após %u horas",
+        "O ciclo atual não tem etapa com a luz %s. Mude o ciclo com %s.",
+        "Irrigação automática ligada.",
+        "Irrigação automática desligada.",
+        "Ciclo atual: %s (%d/%d)",
+        "Irrigação realizada.",
+        "Irrigação registrada.",
+        "Para modificar o intervalo de irrigação mande a mensagem da forma:\n\n%s N\n\nN é o intervalo de irrigação em dias e deve ser maior que zero.",
+        "Intervalo de irrigação alterado de %d dias para %d dias.",
+        "Para modificar o tempo de irrigação mande a mensagem da forma:\n\n%s N\n\nN é o tempo de irrigação em segundos e deve ser maior que zero.",
+        "Tempo de irrigação alterado de %d segundos para %d segundos.",
+        "Status:\n\n"
+        "LUZ \xF0\x9F\x92\xA1 \n"
+        "- Ciclo de luz: %s (%d/%d).\n"
+        "- Status da luz: %s.\n"
+        "- Etapa de iluminação: %d.\n"
+        "- Tempo dês de a ultima mudança na luz: %u horas.\n\n",
+        "IRRIGAÇÃO \xF0\x9F\x9A\xBF \n"
+        "- Intervalo entre irrigações: %d dias.\n"
+        "- Tempo de irrigação: %d segundos.\n"
+        "- Status da auto-irrigação: %s.\n"
+        "- Tempo dês de a ultima irrigação: %u dias e %u horas.\n\n",
+        "VENTILAÇÃO \xF0\x9F\x86\x92 \n"
+        "- Status da ventilação: %s.\n\n",
+        "ENERGIA \xE2\x9A\xA1 \n"
+        "- Modo ocioso: %s.\n"
+        "- Ciclo de trabalho: %.1f%%.\n"
+        "- Heap por consulta: %u bytes (máx. %u bytes).\n"
+        "- Sessão TLS das consultas aberta: %u bytes.\n"
+        "- Menor heap livre desde o boot: %u bytes.\n",
+        "Ventilação %s.",
+        "ligada",
+        "desligada",
+        "Germinação",
+        "Vegetativo",
+        "Floração",
+        "Autoflorescente",
+        "Personalizado",
+        "Desconhecido",
+        "light sleep automático",
+        "modem sleep",
+        "Idioma alterado para português.",
+        "Para mudar o idioma mande a mensagem da forma:\n\n%s pt\nou\n%s en",
+        "\xE2\x9A\xA0 Etapa \"%s\" travou por %u ms (limite de %u ms). Bomba desligada por segurança.",
+        "\xE2\x9A\xA0 GrowBox reiniciada pelo watchdog: etapa \"%s\" travou por %u ms (limite de %u ms). Bomba desligada por segurança.",
+        "rede",
+        "mensagens",
+        "luz",
+        "irrigação",
+        "regras",
+        "atualização",
+        "ocioso",
+        "bomba",
+        "Para mudar o ciclo de luz mande a mensagem de uma das formas:\n\n"
+        "%s ger|veg|flor|auto\n"
+        "%s custom H/D\n"
+        "%s passos 6L 8LF 6L 4-\n\n"
+        "H/D são as horas de luz e de escuro (somando 24). Cada passo é a duração em horas seguida das luzes ligadas: "
+        "L (LED), F (Full Spectrum) ou - (desligadas). Os passos devem somar 24 horas (máximo de %d passos).",
+        "Regra %d adicionada: %s",
+        "Para criar uma regra mande a mensagem da forma:\n\n"
+        "%s SINAL OP VALOR [e SINAL OP VALOR] -> AÇÃO [prioridade N]\n\n"
+        "Sinais: luz e ventilacao (0/1), bomba (segundos da irrigação), hora (HH:MM), temp (°C), solo (%%).\n"
+        "Operadores: > < >= <= = !=\n"
+        "Ações: ligaventilacao, desligaventilacao, ligaluz, desligaluz, irrigar, notificar.\n"
+        "Em conflito vale a regra de maior prioridade.\n\n"
+        "Ex.: %s temp > 28 e luz = 1 -> ligaventilacao prioridade 2\n\n"
+        "Máximo de %d regras.",
+        "Limite de %d regras atingido. Apague uma regra com %s N.",
+        "Nenhuma regra cadastrada.",
+        "Regras:\n",
+        "%d: %s\n",
+        "Regra %d apagada.",
+        "Para apagar uma regra mande a mensagem da forma:\n\n%s N\n\nN é o número da regra em %s.",
+        "Regra %d ativada: %s",
+        "Gráfico das últimas %d horas (linhas verticais a cada 6 horas):\n"
+        "- Luz: amarelo LED, branco LED + FS.\n"
+        "- Ventilação: ciano.\n"
+        "- Bomba: azul.\n"
+        "- Temperatura: vermelho (0-%d °C).\n"
+        "- Umidade do solo: verde (0-100%%).\n\n"
+        "Codificado em %u ms, %u bytes, %u bytes de heap.",
+        "Para ver o gráfico mande a mensagem da forma:\n\n%s N\n\nN são as horas de histórico, de 1 a %d (padrão 24).",
+        "Não foi possível enviar o gráfico.",
+        "Para atualizar o firmware mande a mensagem da forma:\n\n%s URL SHA256\n\n"
+        "ou envie o arquivo firmware.bin como documento com a legenda:\n\n%s SHA256\n\n"
+        "URL é um endereço http:// da rede local (ou https://) e SHA256 é o hash do arquivo (sha256sum firmware.bin). "
+        "Mande %s para ver o progresso e %s cancelar para cancelar.",
+        "Atualização iniciada. O download continua em segundo plano com a GrowBox funcionando; mande %s para ver o progresso.",
+        "Atualização retomada em %u de %u bytes.",
+        "Atualização: %u%% (%u de %u bytes, %u bytes/s).",
+        "Já existe uma atualização em andamento. Mande %s cancelar para cancelar.",
+        "Atualização cancelada.",
+        "Não há partição para a atualização: a tabela de partições não tem OTA.",
+        "Imagem de %u bytes não cabe na partição de %u bytes. Atualização cancelada.",
+        "O arquivo mudou durante o download. Atualização cancelada.",
+        "O arquivo não é um firmware do ESP32. Atualização cancelada.",
+        "Erro ao gravar a flash. Atualização cancelada.",
+        "O SHA-256 da imagem não confere. Atualização cancelada.",
+        "Imagem rejeitada na verificação do bootloader. Atualização cancelada.",
+        "Imagem verificada: %u bytes a %u bytes/s. Reiniciando com o novo firmware...",
+        "Firmware atualizado e validado.",
+        "O novo firmware não se conectou ao bot e a GrowBox voltou para o firmware anterior.",
+    },
+    // LOCALE_EN
+    {
+        "Command %s sent %ld minutes ago was ignored. Send it again to run it.",
+        "Command %s received while the GrowBox was offline was ignored. Send it again to run it.",
+        "--- Connection restored ---",
+        "--- GrowBox active ---",
+        "Light on for %u hours\n%d left to turn off",
+        "Light off for %u hours\n%d left to turn on",
+        "Last irrigation %u days and %u hours ago.",
+        "%d days and %d hours left until the next irrigation.",
+        "Light turned on after %u hours",
+        "Light turned off after %u hours",
+        "The current cycle has no step with the light %s. Change the cycle with %s.",
+        "Auto-irrigation on.",
+        "Auto-irrigation off.",
+        "Current cycle: %s (%d/%d)",
+        "Irrigation done.",
+        "Irrigation registered.",
+        "To change the irrigation interval send the message as:\n\n%s N\n\nN is the irrigation interval in days and must be greater than zero.",
+        "Irrigation interval changed from %d days to %d days.",
+        "To change the irrigation time send the message as:\n\n%s N\n\nN is the irrigation time in seconds and must be greater than zero.",
+        "Irrigation time changed from %d seconds to %d seconds.",
+        "Status:\n\n"
+        "LIGHT \xF0\x9F\x92\xA1 \n"
+        "- Light cycle: %s (%d/%d).\n"
+        "- Light status: %s.\n"
+        "- Light step: %d.\n"
+        "- Time since the last light change: %u hours.\n\n",
+        "IRRIGATION \xF0\x9F\x9A\xBF \n"
+        "- Interval between irrigations: %d days.\n"
+        "- Irrigation time: %d seconds.\n"
+        "- Auto-irrigation status: %s.\n"
+        "- Time since the last irrigation: %u days and %u hours.\n\n",
+        "VENTILATION \xF0\x9F\x86\x92 \n"
+        "- Ventilation status: %s.\n\n",
+        "POWER \xE2\x9A\xA1 \n"
+        "- Idle mode: %s.\n"
+        "- Duty cycle: %.1f%%.\n"
+        "- Heap per poll: %u bytes (max. %u bytes).\n"
+        "- Open poll TLS session: %u bytes.\n"
+        "- Lowest free heap since boot: %u bytes.\n",
+        "Ventilation %s.",
+        "on",
+        "off",
+        "Germination",
+        "Vegetative",
+        "Flowering",
+        "Autoflower",
+        "Custom",
+        "Unknown",
+        "automatic light sleep",
+        "modem sleep",
+        "Language changed to English.",
+        "To change the language send the message as:\n\n%s pt\nor\n%s en",
+        "\xE2\x9A\xA0 Stage \"%s\" stalled for %u ms (budget of %u ms). Pump turned off for safety.",
+        "\xE2\x9A\xA0 GrowBox restarted by the watchdog: stage \"%s\" stalled for %u ms (budget of %u ms). Pump turned off for safety.",
+        "network",
+        "messages",
+        "light",
+        "irrigation",
+        "rules",
+        "update",
+        "idle",
+        "pump",
+        "To change the light cycle send the message in one of the forms:\n\n"
+        "%s ger|veg|flor|auto\n"
+        "%s custom H/D\n"
+        "%s passos 6L 8LF 6L 4-\n\n"
+        "H/D are the hours of light and of dark (adding up to 24). Each step is the duration in hours followed by the lights on: "
+        "L (LED), F (Full Spectrum) or - (off). The steps must add up to 24 hours (at most %d steps).",
+        "Rule %d added: %s",
+        "To create a rule send the message as:\n\n"
+        "%s SIGNAL OP VALUE [e SIGNAL OP VALUE] -> ACTION [prioridade N]\n\n"
+        "Signals: luz and ventilacao (0/1), bomba (irrigation seconds), hora (HH:MM), temp (°C), solo (%%).\n"
+        "Operators: > < >= <= = !=\n"
+        "Actions: ligaventilacao, desligaventilacao, ligaluz, desligaluz, irrigar, notificar.\n"
+        "On conflicts the rule with the highest priority wins.\n\n"
+        "E.g.: %s temp > 28 e luz = 1 -> ligaventilacao prioridade 2\n\n"
+        "At most %d rules.",
+        "Limit of %d rules reached. Delete a rule with %s N.",
+        "No rules registered.",
+        "Rules:\n",
+        "%d: %s\n",
+        "Rule %d deleted.",
+        "To delete a rule send the message as:\n\n%s N\n\nN is the rule number in %s.",
+        "Rule %d triggered: %s",
+        "Chart of the last %d hours (vertical lines every 6 hours):\n"
+        "- Light: yellow LED, white LED + FS.\n"
+        "- Ventilation: cyan.\n"
+        "- Pump: blue.\n"
+        "- Temperature: red (0-%d °C).\n"
+        "- Soil moisture: green (0-100%%).\n\n"
+        "Encoded in %u ms, %u bytes, %u bytes of heap.",
+        "To see the chart send the message as:\n\n%s N\n\nN is the hours of history, from 1 to %d (default 24).",
+        "The chart could not be sent.",
+        "To update the firmware send the message as:\n\n%s URL SHA256\n\n"
+        "or send the firmware.bin file as a document with the caption:\n\n%s SHA256\n\n"
+        "URL is an http:// address in the local network (or https://) and SHA256 is the hash of the file (sha256sum firmware.bin). "
+        "Send %s to see the progress and %s cancelar to cancel.",
+        "Update started. The download goes on in the background with the GrowBox running; send %s to see the progress.",
+        "Update resumed at %u of %u bytes.",
+        "Update: %u%% (%u of %u bytes, %u bytes/s).",
+        "An update is already running. Send %s cancelar to cancel it.",
+        "Update cancelled.",
+        "There is no update partition: the partition table has no OTA.",
+        "Image of %u bytes does not fit the partition of %u bytes. Update cancelled.",
+        "The file changed during the download. Update cancelled.",
+        "The file is not an ESP32 firmware. Update cancelled.",
+        "Flash write error. Update cancelled.",
+        "The SHA-256 of the image does not match. Update cancelled.",
+        "Image rejected by the bootloader check. Update cancelled.",
+        "Image verified: %u bytes at %u bytes/s. Restarting with the new firmware...",
+        "Firmware updated and validated.",
+        "The new firmware did not reach the bot and the GrowBox went back to the previous firmware.",
+    },
+};
+
+//-----------------------
+
+const char *getCatalogText(Locale locale, MessageId id)
+{
+  return messageCatalog[locale][id];
+}
+
+//-----------------------
+
+size_t renderCatalogText(char *buffer, size_t size, size_t offset, Locale locale, MessageId id, va_list args)
+{
+  if (offset + 1 >= size)
+  {
+    return offset;
+  }
+
+  int written = vsnprintf(buffer + offset, size - offset, getCatalogText(locale, id), args);
+  if (written < 0)
+  {
+    return offset;
+  }
+  // truncated messages end at the buffer limit
+  return offset + written < size ? offset + written : size - 1;
+}
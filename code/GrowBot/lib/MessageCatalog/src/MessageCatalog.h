@@ -0,0 +1,104 @@
+#ifndef MESSAGE_CATALOG_H
+#define MESSAGE_CATALOG_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+// Message catalog locales
+enum Locale
+{
+  LOCALE_PT_BR,
+  LOCALE_EN,
+  LOCALE_COUNT,
+};
+
+// Message catalog ids - add any new user-facing text here and in every locale of messageCatalog (MessageCatalog.cpp)
+enum MessageId
+{
+  MSG_STALE_COMMAND,
+  MSG_OFFLINE_COMMAND,
+  MSG_CONNECTION_RESTORED,
+  MSG_GROWBOX_ACTIVE,
+  MSG_LIGHT_ON_SINCE,
+  MSG_LIGHT_OFF_SINCE,
+  MSG_LAST_IRRIGATION,
+  MSG_NEXT_IRRIGATION,
+  MSG_LIGHT_TURNED_ON,
+  MSG_LIGHT_TURNED_OFF,
+  MSG_LIGHT_NO_STEP,
+  MSG_AUTO_IRRIGATION_ON,
+  MSG_AUTO_IRRIGATION_OFF,
+  MSG_CURRENT_CYCLE,
+  MSG_IRRIGATION_DONE,
+  MSG_IRRIGATION_REGISTERED,
+  MSG_IRRIGATION_INTERVAL_HELP,
+  MSG_IRRIGATION_INTERVAL_CHANGED,
+  MSG_IRRIGATION_TIME_HELP,
+  MSG_IRRIGATION_TIME_CHANGED,
+  MSG_STATUS_LIGHT,
+  MSG_STATUS_IRRIGATION,
+  MSG_STATUS_VENTILATION,
+  MSG_STATUS_ENERGY,
+  MSG_VENTILATION_STATUS,
+  MSG_ON,
+  MSG_OFF,
+  MSG_CYCLE_GER,
+  MSG_CYCLE_VEG,
+  MSG_CYCLE_FLOR,
+  MSG_CYCLE_AUTO,
+  MSG_CYCLE_CUSTOM,
+  MSG_CYCLE_UNKNOWN,
+  MSG_IDLE_LIGHT_SLEEP,
+  MSG_IDLE_MODEM_SLEEP,
+  MSG_LOCALE_CHANGED,
+  MSG_LOCALE_HELP,
+  MSG_STALL_DETECTED,
+  MSG_STALL_REBOOT,
+  MSG_STAGE_NETWORK,
+  MSG_STAGE_COMMANDS,
+  MSG_STAGE_LIGHT,
+  MSG_STAGE_IRRIGATION,
+  MSG_STAGE_RULES,
+  MSG_STAGE_OTA,
+  MSG_STAGE_IDLE,
+  MSG_STAGE_PUMP,
+  MSG_CYCLE_HELP,
+  MSG_RULE_ADDED,
+  MSG_RULE_HELP,
+  MSG_RULES_FULL,
+  MSG_RULES_EMPTY,
+  MSG_RULES_HEADER,
+  MSG_RULE_LINE,
+  MSG_RULE_DELETED,
+  MSG_RULE_DELETE_HELP,
+  MSG_RULE_TRIGGERED,
+  MSG_CHART_LEGEND,
+  MSG_CHART_HELP,
+  MSG_CHART_FAILED,
+  MSG_OTA_HELP,
+  MSG_OTA_STARTED,
+  MSG_OTA_RESUMED,
+  MSG_OTA_PROGRESS,
+  MSG_OTA_BUSY,
+  MSG_OTA_CANCELLED,
+  MSG_OTA_NO_PARTITION,
+  MSG_OTA_TOO_LARGE,
+  MSG_OTA_SOURCE_CHANGED,
+  MSG_OTA_NOT_FIRMWARE,
+  MSG_OTA_FLASH_FAILED,
+  MSG_OTA_HASH_MISMATCH,
+  MSG_OTA_INVALID_IMAGE,
+  MSG_OTA_INSTALLED,
+  MSG_OTA_UPDATED,
+  MSG_OTA_ROLLED_BACK,
+  MSG_COUNT,
+};
+
+// Text of a message in a locale (printf template)
+const char *getCatalogText(Locale locale, MessageId id);
+
+// Render a message at offset of a buffer with size bytes, without heap allocations.
+// Returns the new length - truncated messages end at the buffer limit.
+size_t renderCatalogText(char *buffer, size_t size, size_t offset, Locale locale, MessageId id, va_list args);
+
+#endif
@@ -0,0 +1,196 @@
+#include "RuleEngine.h"
+
+static_assert(MAX_RULES <= 8, "RulePass.notifications has one bit per rule");
+static_assert(SIGNAL_COUNT <= 8, "the signal masks have one bit per signal");
+
+void initRuleEngine(RuleEngine &engine)
+{
+  engine.ruleCount = 0;
+  engine.knownSignals = 0;
+  engine.dirtySignals = 0;
+}
+
+//-----------------------
+
+bool isValidRule(const Rule &rule)
+{
+  if (rule.conditionCount == 0 || rule.conditionCount > MAX_RULE_CONDITIONS || rule.action >= ACTION_COUNT)
+  {
+    return false;
+  }
+  for (int i = 0; i < rule.conditionCount; i++)
+  {
+    if (rule.conditions[i].signal >= SIGNAL_COUNT || rule.conditions[i].op >= OP_COUNT)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+//-----------------------
+
+bool appendRule(RuleEngine &engine, const Rule &rule)
+{
+  if (engine.ruleCount >= MAX_RULES)
+  {
+    return false;
+  }
+  int index = engine.ruleCount;
+  engine.rules[index] = rule;
+  engine.active[index] = false;
+  engine.inputMasks[index] = 0;
+  for (int i = 0; i < rule.conditionCount; i++)
+  {
+    engine.inputMasks[index] |= 1 << rule.conditions[i].signal;
+  }
+  engine.ruleCount++;
+  // The new rule is evaluated with the current signals on the next pass
+  engine.dirtySignals |= engine.inputMasks[index];
+  return true;
+}
+
+//-----------------------
+
+bool removeRule(RuleEngine &engine, int index)
+{
+  if (index < 0 || index >= engine.ruleCount)
+  {
+    return false;
+  }
+  bool wasActive = engine.active[index];
+  for (int i = index; i < engine.ruleCount - 1; i++)
+  {
+    engine.rules[i] = engine.rules[i + 1];
+    engine.active[i] = engine.active[i + 1];
+    engine.inputMasks[i] = engine.inputMasks[i + 1];
+  }
+  engine.ruleCount--;
+  return wasActive;
+}
+
+//-----------------------
+
+void setRuleSignal(RuleEngine &engine, int signal, int16_t value)
+{
+  uint8_t bit = 1 << signal;
+  if ((engine.knownSignals & bit) && engine.signalValues[signal] == value)
+  {
+    return;
+  }
+  engine.signalValues[signal] = value;
+  engine.knownSignals |= bit;
+  engine.dirtySignals |= bit;
+}
+
+//-----------------------
+
+bool evaluateRule(const RuleEngine &engine, const Rule &rule)
+{
+  for (int i = 0; i < rule.conditionCount; i++)
+  {
+    const RuleCondition &condition = rule.conditions[i];
+    // Unknown signals (no sensor) never satisfy a condition
+    if ((engine.knownSignals & (1 << condition.signal)) == 0)
+    {
+      return false;
+    }
+    int16_t value = engine.signalValues[condition.signal];
+    bool result = false;
+    switch (condition.op)
+    {
+    case OP_GREATER:
+      result = value > condition.value;
+      break;
+    case OP_LESS:
+      result = value < condition.value;
+      break;
+    case OP_GREATER_EQUAL:
+      result = value >= condition.value;
+      break;
+    case OP_LESS_EQUAL:
+      result = value <= condition.value;
+      break;
+    case OP_EQUAL:
+      result = value == condition.value;
+      break;
+    case OP_NOT_EQUAL:
+      result = value != condition.value;
+      break;
+    default:
+      break;
+    }
+    if (!result)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+//-----------------------
+
+bool runRulePass(RuleEngine &engine, RulePass &pass)
+{
+  pass = {};
+  if (engine.dirtySignals == 0)
+  {
+    return false;
+  }
+  uint8_t dirty = engine.dirtySignals;
+  engine.dirtySignals = 0;
+
+  for (int i = 0; i < engine.ruleCount; i++)
+  {
+    if ((engine.inputMasks[i] & dirty) == 0)
+    {
+      continue;
+    }
+    bool active = evaluateRule(engine, engine.rules[i]);
+    if (active == engine.active[i])
+    {
+      continue;
+    }
+    engine.active[i] = active;
+
+    switch (engine.rules[i].action)
+    {
+    case ACTION_VENTILATION_ON:
+    case ACTION_VENTILATION_OFF:
+      pass.ventilationChanged = true;
+      break;
+    case ACTION_LIGHT_ON:
+    case ACTION_LIGHT_OFF:
+      pass.lightChanged = true;
+      break;
+    case ACTION_IRRIGATE:
+      pass.irrigate = pass.irrigate || active;
+      break;
+    case ACTION_NOTIFY:
+      if (active)
+      {
+        pass.notifications |= 1 << i;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  return true;
+}
+
+//-----------------------
+
+int findActuatorRule(const RuleEngine &engine, int onAction, int offAction)
+{
+  int winner = -1;
+  for (int i = 0; i < engine.ruleCount; i++)
+  {
+    if (engine.active[i] && (engine.rules[i].action == onAction || engine.rules[i].action == offAction) &&
+        (winner < 0 || engine.rules[i].priority > engine.rules[winner].priority))
+    {
+      winner = i;
+    }
+  }
+  return winner;
+}
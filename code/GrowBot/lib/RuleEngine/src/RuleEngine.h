@@ -0,0 +1,109 @@
+#ifndef RULE_ENGINE_H
+#define RULE_ENGINE_H
+
+#include <stdint.h>
+
+// Maximum number of automation rules and of conditions in one rule
+#define MAX_RULES 8
+#define MAX_RULE_CONDITIONS 3
+
+// Signals read by the automation rules
+enum Signal
+{
+  SIGNAL_LIGHT,       // light on (1) or off (0)
+  SIGNAL_VENTILATION, // ventilation on (1) or off (0)
+  SIGNAL_PUMP,        // seconds of the current irrigation, 0 while the pump is off
+  SIGNAL_TIME,        // local time of day in minutes
+  SIGNAL_TEMPERATURE, // °C - unknown until a sensor feeds it
+  SIGNAL_SOIL,        // soil moisture in % - unknown until a sensor feeds it
+  SIGNAL_COUNT,
+};
+
+// Rule comparison operators
+enum RuleOperator
+{
+  OP_GREATER,
+  OP_LESS,
+  OP_GREATER_EQUAL,
+  OP_LESS_EQUAL,
+  OP_EQUAL,
+  OP_NOT_EQUAL,
+  OP_COUNT,
+};
+
+// Rule actions - ventilation and light follow the rule state, irrigate and notify run when the rule becomes true
+enum RuleAction
+{
+  ACTION_VENTILATION_ON,
+  ACTION_VENTILATION_OFF,
+  ACTION_LIGHT_ON,
+  ACTION_LIGHT_OFF,
+  ACTION_IRRIGATE,
+  ACTION_NOTIFY,
+  ACTION_COUNT,
+};
+
+// Compiled rule condition: signal OP value
+struct RuleCondition
+{
+  uint8_t signal;
+  uint8_t op;
+  int16_t value;
+};
+
+// Compiled rule: all conditions true -> action
+struct Rule
+{
+  uint8_t conditionCount;
+  uint8_t action;
+  uint8_t priority;
+  RuleCondition conditions[MAX_RULE_CONDITIONS];
+};
+
+// Automation rules, the signals they read and the result of their last evaluation
+struct RuleEngine
+{
+  Rule rules[MAX_RULES];
+  int ruleCount;
+  uint8_t inputMasks[MAX_RULES]; // signals read by each rule (bit per Signal) - a rule is only evaluated when one of them changes
+  bool active[MAX_RULES];
+  int16_t signalValues[SIGNAL_COUNT];
+  uint8_t knownSignals;
+  uint8_t dirtySignals; // changed since the last pass
+};
+
+// Actions due after an evaluation pass - the caller runs them, so a pass never runs inside another one
+struct RulePass
+{
+  bool ventilationChanged; // a ventilation rule changed state: the actuator follows the active rule with the highest priority
+  bool lightChanged;       // same for the light
+  bool irrigate;           // an irrigate rule became true
+  uint8_t notifications;   // bit per rule whose notify action became true
+};
+
+// Start without rules and with every signal unknown
+void initRuleEngine(RuleEngine &engine);
+
+// Indicates that a rule (read from EEPROM) has valid counts, signals, operators and action
+bool isValidRule(const Rule &rule);
+
+// Add a rule, evaluated on the next pass. Returns false if there is no room.
+bool appendRule(RuleEngine &engine, const Rule &rule);
+
+// Remove the rule at index. Returns true if it was active (it may have been holding an actuator).
+bool removeRule(RuleEngine &engine, int index);
+
+// Update a signal - only a new value marks it for evaluation
+void setRuleSignal(RuleEngine &engine, int signal, int16_t value);
+
+// Indicates that all the conditions of a rule are true (unknown signals never are)
+bool evaluateRule(const RuleEngine &engine, const Rule &rule);
+
+// Evaluate the rules whose signals changed. Returns false if no signal changed.
+// Signals changed while the caller runs the actions are evaluated on the next pass.
+bool runRulePass(RuleEngine &engine, RulePass &pass);
+
+// Active rule with the highest priority (the first one on a tie) among an actuator action pair, -1 if none
+int findActuatorRule(const RuleEngine &engine, int onAction, int offAction);
+
+#endif
@@ -0,0 +1,12 @@
+#include "LoopStages.h"
+
+const uint32_t stageBudgets[STAGE_COUNT] = {
+    30000,                // STAGE_NETWORK: 10 s WiFi wait + init/reconnect messages
+    20000,                // STAGE_COMMANDS: one getUpdates page or one command
+    10000,                // STAGE_LIGHT: light change message
+    10000,                // STAGE_IRRIGATION: reminder message
+    10000,                // STAGE_RULES: rule actions and notifications
+    20000,                // STAGE_OTA: download slice, (re)connection and progress messages
+    MAX_IDLE_TIME + 2000, // STAGE_IDLE: never sleeps longer than MAX_IDLE_TIME
+    15000,                // STAGE_PUMP: one 1 s irrigation step and the rules it triggers
+};
@@ -0,0 +1,27 @@
+#ifndef LOOP_STAGES_H
+#define LOOP_STAGES_H
+
+#include <stdint.h>
+#include <LoopJobs.h>
+
+// Task watchdog timeout in seconds - reboots the board when a stage hangs past its budget
+#define WATCHDOG_TIMEOUT 60
+
+// Stages of the loop, each one with its own latency budget
+enum LoopStage
+{
+  STAGE_NETWORK,
+  STAGE_COMMANDS,
+  STAGE_LIGHT,
+  STAGE_IRRIGATION,
+  STAGE_RULES,
+  STAGE_OTA,
+  STAGE_IDLE,
+  STAGE_PUMP,
+  STAGE_COUNT,
+};
+
+// Latency budget of each stage in milliseconds - all below WATCHDOG_TIMEOUT - STAGE_WATCHDOG_MARGIN (initStageMonitor clamps them)
+extern const uint32_t stageBudgets[STAGE_COUNT];
+
+#endif
@@ -0,0 +1,55 @@
+#include "StageMonitor.h"
+
+void initStageMonitor(StageMonitor &monitor, const uint32_t *budgets, int stageCount, uint32_t watchdogTimeout)
+{
+  monitor.budgets = budgets;
+  monitor.stageCount = stageCount;
+  monitor.maxBudget = watchdogTimeout > STAGE_WATCHDOG_MARGIN ? watchdogTimeout - STAGE_WATCHDOG_MARGIN : 0;
+  monitor.stage = 0;
+  monitor.start = 0;
+  monitor.overrun = false;
+}
+
+//-----------------------
+
+uint32_t getStageBudget(const StageMonitor &monitor, int stage)
+{
+  if (stage < 0 || stage >= monitor.stageCount)
+  {
+    return monitor.maxBudget;
+  }
+  return monitor.budgets[stage] < monitor.maxBudget ? monitor.budgets[stage] : monitor.maxBudget;
+}
+
+//-----------------------
+
+bool beginMonitoredStage(StageMonitor &monitor, int stage, uint32_t now)
+{
+  bool endedLate = monitor.overrun;
+  monitor.stage = stage;
+  monitor.start = now;
+  monitor.overrun = false;
+  return endedLate;
+}
+
+//-----------------------
+
+StageCheck checkMonitoredStage(StageMonitor &monitor, uint32_t now, uint32_t &nextCheck)
+{
+  uint32_t elapsed = now - monitor.start;
+  uint32_t budget = getStageBudget(monitor, monitor.stage);
+  if (elapsed <= budget)
+  {
+    // Over the budget means strictly after it
+    nextCheck = budget - elapsed + 1;
+    return STAGE_ON_TIME;
+  }
+
+  nextCheck = STALL_UPDATE_PERIOD;
+  if (monitor.overrun)
+  {
+    return STAGE_STILL_OVERRUN;
+  }
+  monitor.overrun = true;
+  return STAGE_OVERRUN;
+}
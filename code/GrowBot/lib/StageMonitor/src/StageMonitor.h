@@ -0,0 +1,42 @@
+#ifndef STAGE_MONITOR_H
+#define STAGE_MONITOR_H
+
+#include <stdint.h>
+
+// Milliseconds every stage budget stays below the watchdog timeout, so a stall is recorded before the reset
+#define STAGE_WATCHDOG_MARGIN 5000
+// Milliseconds between the updates of a stall length while the stage is still over its budget
+#define STALL_UPDATE_PERIOD 1000
+
+// Result of a stage check
+enum StageCheck
+{
+  STAGE_ON_TIME,       // still inside its budget
+  STAGE_OVERRUN,       // just went over its budget
+  STAGE_STILL_OVERRUN, // was already over its budget
+};
+
+// Latency budgets of the loop stages and the stage being timed
+struct StageMonitor
+{
+  const uint32_t *budgets;
+  int stageCount;
+  uint32_t maxBudget;
+  int stage;
+  uint32_t start;
+  bool overrun;
+};
+
+// Start monitoring with a budget per stage in milliseconds, clamped below the watchdog timeout (ms)
+void initStageMonitor(StageMonitor &monitor, const uint32_t *budgets, int stageCount, uint32_t watchdogTimeout);
+
+// Budget of a stage in milliseconds
+uint32_t getStageBudget(const StageMonitor &monitor, int stage);
+
+// Start timing a stage at now. Returns true if the previous stage ended after its budget.
+bool beginMonitoredStage(StageMonitor &monitor, int stage, uint32_t now);
+
+// Check the current stage at now. nextCheck gets the milliseconds until it needs checking again.
+StageCheck checkMonitoredStage(StageMonitor &monitor, uint32_t now, uint32_t &nextCheck);
+
+#endif
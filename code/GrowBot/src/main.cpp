@@ -8,18 +8,118 @@
 #include <WiFiClientSecure.h>
 // Library for the Telegram Bot
 #include <UniversalTelegramBot.h>
+// Library to parse the getUpdates responses straight from the connection
+#include <ArduinoJson.h>
 // Library to access the ESP32 EEPROM memory
 #include <EEPROM.h>
+// ESP-IDF power management (automatic light sleep)
+#include <esp_pm.h>
+// System clock synchronized by NTP
+#include <time.h>
+// ESP-IDF task watchdog, high resolution timer and reset reason
+#include <esp_task_wdt.h>
+#include <esp_timer.h>
+#include <esp_system.h>
+// lwIP sockets: the idle wait sleeps on the long poll socket until Telegram answers
+#include <lwip/sockets.h>
+// ESP-IDF OTA partitions, image format and streaming SHA-256 for the firmware updates
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_image_format.h>
+#include <mbedtls/sha256.h>
+// Next deadline among the periodic jobs of the loop (lib/Deadlines, tested on the host)
+#include <Deadlines.h>
+// Periods of the timed loop jobs (lib/Deadlines, shared with its host tests)
+#include <LoopJobs.h>
+// User-facing texts in pt-BR/en (lib/MessageCatalog, tested on the host)
+#include <MessageCatalog.h>
+// Latency budget of the loop stages (lib/StageMonitor, tested on the host)
+#include <StageMonitor.h>
+// Loop stages, their budgets and the watchdog timeout (lib/StageMonitor, shared with its host tests)
+#include <LoopStages.h>
+// History chart streamed as a PNG (lib/HistoryChart, tested on the host)
+#include <HistoryChart.h>
+// Automation rules: signals, conditions and evaluation passes (lib/RuleEngine, tested on the host)
+#include <RuleEngine.h>
 // File with the personal info - Instructions to crete in https://github.com/dimeno157/GrowBot
 #include "personal_info.h"
 
 //-------------------------------------------------------------------------------------------------------------
 
-// Number of milliseconds in one hour
-#define ONE_HOUR 3600000
 #define OFF 0
 #define ON 1
 
+// Seconds Telegram holds a getUpdates request open waiting for a message (long polling) - the board idles meanwhile
+#define LONG_POLL_TIMEOUT 25
+// Extra milliseconds to wait for a long poll answer before the connection is dropped
+#define LONG_POLL_MARGIN 10000
+// Milliseconds to wait for the answer of a short poll (backlog pages)
+#define POLL_RESPONSE_TIMEOUT 10000
+// Seconds before a stuck TLS handshake is given up - a normal retry instead of a watchdog reset
+#define TLS_HANDSHAKE_TIMEOUT 10
+// CPU frequency (MHz) while handling work and while idle - WiFi needs at least 80 MHz
+#define ACTIVE_CPU_FREQ 240
+#define IDLE_CPU_FREQ 80
+
+// Commands that act on the box older than this (in seconds) are not executed, only reported
+#define MAX_COMMAND_AGE 600
+// Maximum number of commands buffered while draining the backlog after (re)connecting
+#define MAX_BACKLOG_COMMANDS 32
+// Any epoch before this means the clock was not synchronized by NTP yet (2022-01-01)
+#define VALID_EPOCH 1640995200
+// Local time zone (POSIX TZ) used by the time of day of the automation rules
+#define TIMEZONE "<-03>3"
+
+// Maximum number of updates requested in one getUpdates call
+#define MAX_UPDATES_PER_POLL 16
+// pollUpdates results besides the number of updates: the poll failed (connection, answer timeout, bad response), or the
+// page did not fit the document and is requested again (one update at a time)
+#define POLL_FAILED -1
+#define POLL_RETRY_PAGE -2
+// Size of the fixed JSON document that holds one filtered getUpdates page
+#define UPDATES_DOCUMENT_SIZE 6144
+// Period in microseconds of the free heap sampling while a poll runs
+#define HEAP_SAMPLE_PERIOD 1000
+// Longest command text kept from a message (longer texts are truncated)
+#define MAX_COMMAND_LENGTH 96
+
+// Size of the buffer where the catalog messages are rendered
+#define MESSAGE_BUFFER_SIZE 1024
+
+// Marks a valid stall record in the RTC memory (which is not cleared by resets)
+#define STALL_RECORD_MAGIC 0x57A11ED0
+
+// Maximum number of steps of a light profile
+#define MAX_LIGHT_STEPS 8
+// Light step mask bits: which lights are on during the step
+#define LIGHT_LED 0x01
+#define LIGHT_FS 0x02
+static_assert(HISTORY_LED == LIGHT_LED && HISTORY_FS == LIGHT_FS, "the history light flags are the light step mask");
+
+// History samples per hour (one per HISTORY_PERIOD)
+#define HISTORY_SAMPLES_PER_HOUR 4
+// Hours of history kept for the charts (7 days)
+#define HISTORY_HOURS 168
+#define HISTORY_SAMPLES (HISTORY_HOURS * HISTORY_SAMPLES_PER_HOUR)
+// Firmware image chunk: one flash sector, erased right before it is written
+#define OTA_CHUNK_SIZE SPI_FLASH_SEC_SIZE
+// Milliseconds of download per loop - the other stages (and the actuators) run in between
+#define OTA_SLICE_TIME 250
+// Bytes written between two saves of the download progress in EEPROM
+#define OTA_SAVE_INTERVAL 65536
+// Milliseconds without data before the download connection is dropped
+#define OTA_STALL_TIMEOUT 20000
+// Milliseconds for a new firmware to reach the bot before it is rolled back
+#define OTA_VERIFY_TIMEOUT 600000
+// Boots a new firmware gets to reach the bot (resets by crash or watchdog included) before it is rolled back
+#define OTA_MAX_BOOT_ATTEMPTS 3
+// Marks a valid firmware update record in EEPROM (changes with the record layout)
+#define OTA_RECORD_MAGIC 0x07A0D10B
+// Longest update location kept: the URL of "/ota URL SHA256" (out of the command text) or the Telegram file id
+#define OTA_LOCATION_SIZE 160
+// Longest download URL (the Telegram file URLs include the bot token)
+#define OTA_URL_SIZE 192
+
 // VARIABLES --------------------------------------------------------------------------------------------------
 
 /* ENVIAR PARA O @BotFather o comando /setcommands,
@@ -29,7 +129,7 @@
   luz - Status da luz.
   ligaluz - Liga a luz.
   desligaluz - Desliga a luz.
-  ciclo - Ciclo de luz atual.
+  ciclo - Ciclo de luz atual (/ciclo auto, /ciclo custom 20/4, /ciclo passos 6L 8LF 6L 4-).
   ger - Muda para germinação(16/8).
   veg - Muda para vegetativo(18/6).
   flor - Muda para floração(12/12).
@@ -43,6 +143,12 @@
   ventilacao - Status da ventilação.
   ligaventilacao - Liga a ventilação.
   desligaventilacao - Desliga a ventilação.
+  idioma - Muda o idioma das mensagens (pt/en).
+  regra - Cria uma regra de automação.
+  regras - Lista as regras de automação.
+  apagaregra - Apaga uma regra de automação.
+  grafico - Gráfico do histórico (/grafico horas).
+  ota - Atualiza o firmware (/ota URL SHA256 ou documento com a legenda /ota SHA256).
 
   para criar o menu (que fica no canto superior esquerdo do teclado) do bot
   Modifique de acordo com os seus comandos.
@@ -51,35 +157,143 @@
 // Commands strings - add any new command here
 struct Commands
 {
-  String status = "/status";
-  String light = "/luz";
-  String lightOn = "/ligaluz";
-  String lightOff = "/desligaLuz";
-  String lightCycle = "/ciclo";
-  String ger = "/ger";
-  String veg = "/veg";
-  String flor = "/flor";
-  String irrigation = "/irrigacao";
-  String irrigate = "/irrigar";
-  String irrigated = "/irrigado";
-  String autoIrrigationOn = "/ligaautoirrigacao";
-  String autoIrrigationOff = "/desligaautoirrigacao";
-  String irrigationInterval = "/intervaloirrigacao";
-  String irrigationTime = "/tempoirrigacao";
-  String ventilation = "/ventilacao";
-  String ventilationOn = "/ligaventilacao";
-  String ventilationOff = "/desligaventilacao";
+  const char *status = "/status";
+  const char *light = "/luz";
+  const char *lightOn = "/ligaluz";
+  const char *lightOff = "/desligaLuz";
+  const char *lightCycle = "/ciclo";
+  const char *ger = "/ger";
+  const char *veg = "/veg";
+  const char *flor = "/flor";
+  const char *irrigation = "/irrigacao";
+  const char *irrigate = "/irrigar";
+  const char *irrigated = "/irrigado";
+  const char *autoIrrigationOn = "/ligaautoirrigacao";
+  const char *autoIrrigationOff = "/desligaautoirrigacao";
+  const char *irrigationInterval = "/intervaloirrigacao";
+  const char *irrigationTime = "/tempoirrigacao";
+  const char *ventilation = "/ventilacao";
+  const char *ventilationOn = "/ligaventilacao";
+  const char *ventilationOff = "/desligaventilacao";
+  const char *language = "/idioma";
+  const char *rules = "/regras";
+  const char *rule = "/regra";
+  const char *deleteRule = "/apagaregra";
+  const char *chart = "/grafico";
+  const char *ota = "/ota";
 
 } commands;
 
+// Stall of a stage over its budget - kept in RTC memory to be reported after a watchdog reset
+struct StallRecord
+{
+  uint32_t magic;
+  uint32_t stage;
+  uint32_t elapsed;
+  uint32_t budget;
+};
+
+// Last stall, survives software and watchdog resets
+RTC_NOINIT_ATTR StallRecord stallRecord;
+
+// Stage currently running, when it started and if it overran its budget (shared with the monitor timer task)
+StageMonitor stageMonitor;
+portMUX_TYPE stageMonitorLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Indicates that stallRecord must be reported, and if it caused a reboot
+bool stallReportPending;
+bool stallRebooted;
+
+// One-shot timer armed at the end of the current stage budget
+esp_timer_handle_t stageMonitorTimer;
+
+// Words of the rules syntax, in the same order as the enums
+const char *const signalNames[SIGNAL_COUNT] = {"luz", "ventilacao", "bomba", "hora", "temp", "solo"};
+const char *const operatorNames[OP_COUNT] = {">", "<", ">=", "<=", "=", "!="};
+const char *const actionNames[ACTION_COUNT] = {"ligaventilacao", "desligaventilacao", "ligaluz", "desligaluz", "irrigar", "notificar"};
+
+// Automation rules and the signals they read
+RuleEngine ruleEngine;
+
+// Indicates that the actions of a rule pass are running (they may change signals, evaluated on the next pass)
+bool evaluatingRules;
+
+// Indicates that the irrigation pump is running
+bool irrigating;
+
+// Ring buffer with the last HISTORY_SAMPLES periods
+HistorySample history[HISTORY_SAMPLES];
+int historyHead;
+int historyCount;
+
+// Time in milliseconds of the last history sample
+unsigned long lastHistorySample;
+
+// Indicates that the pump ran since the last history sample
+bool pumpRanSinceSample;
+
+// Streaming PNG encoder of the chart being uploaded, and its encoding time in microseconds
+ChartEncoder chartEncoder;
+unsigned long chartEncodeTime;
+
+// Current locale of the bot messages
+Locale currentLocale;
+
+// Buffer where the catalog messages are rendered before being sent (no String concatenation)
+char messageBuffer[MESSAGE_BUFFER_SIZE];
+
 // Client for secure WiFi connections
 WiFiClientSecure client;
 
 // Object for connecting in the Telegram Bot
 UniversalTelegramBot GrowBot(TOKEN, client);
 
-// light cycle -> 'veg', 'flor', 'ger'
-String lightCycle;
+// Light profile ids - presets first, in the same order as lightPresets
+enum LightProfileId
+{
+  PROFILE_GER,
+  PROFILE_VEG,
+  PROFILE_FLOR,
+  PROFILE_AUTO,
+  PROFILE_CUSTOM,
+  PROFILE_COUNT,
+};
+
+// One step of a light profile: duration and lights on (LIGHT_LED/LIGHT_FS mask, 0 is dark)
+struct LightStep
+{
+  uint8_t hours;
+  uint8_t mask;
+};
+
+// Light profile: sequence of steps adding up to 24 hours
+struct LightProfile
+{
+  uint8_t id;
+  uint8_t stepCount;
+  LightStep steps[MAX_LIGHT_STEPS];
+};
+
+// Named light presets: the hours of light are split in LED / LED + FS / LED thirds, followed by the dark
+struct LightPreset
+{
+  const char *name;
+  uint8_t hoursOn;
+  MessageId label;
+};
+
+const LightPreset lightPresets[] = {
+    {"ger", 16, MSG_CYCLE_GER},
+    {"veg", 18, MSG_CYCLE_VEG},
+    {"flor", 12, MSG_CYCLE_FLOR},
+    {"auto", 20, MSG_CYCLE_AUTO},
+};
+
+// Current light profile - only changes on /ger, /veg, /flor or /ciclo
+LightProfile lightProfile;
+
+// Hours of light per day of the current profile, updated with the profile
+int lightHoursOn;
 
 // Main menu string
 String responseKeyboardMenu;
@@ -90,10 +304,7 @@ String lightMenu;
 // Irrigation menu string
 String irrigationMenu;
 
-// 0: LED Light ON
-// 1: FS Light ON
-// 2: LED Light ON
-// 3: Lights OFF
+// Index of the current step in lightProfile.steps
 int currentLightStep;
 
 // LED light pin
@@ -123,12 +334,29 @@ int irrigationTimeAddress = 3;
 // EEPROM address for the irrigation time validity flag
 int irrigationTimeFlagAddress = 4;
 
-// Light periods in hours:
-// [0] -> LED ON (first time)
-// [1] -> FS ON
-// [2] -> LED ON (second time)
-// [3] -> Light OFF
-int lightPeriodsInHours[4];
+// EEPROM address for the last Telegram update id (4 bytes)
+int lastUpdateIdAddress = 5;
+
+// EEPROM address for the last Telegram update id validity flag
+int lastUpdateIdFlagAddress = 9;
+
+// EEPROM address for the messages locale
+int localeAddress = 10;
+
+// EEPROM address for the light profile validity flag
+int lightProfileFlagAddress = 11;
+
+// EEPROM address for the light profile (id, step count and one packed byte per step)
+int lightProfileAddress = 12;
+
+// EEPROM address for the number of automation rules
+int ruleCountAddress = 22;
+
+// EEPROM address for the automation rules (MAX_RULES compiled rules)
+int rulesAddress = 23;
+
+// EEPROM address for the firmware update record (OtaRecord)
+int otaAddress = 152;
 
 // Interval between irrigations in days
 int irrigationIntervalInDays;
@@ -145,12 +373,19 @@ unsigned long timeNow;
 // Hours since last light change
 unsigned int hoursSinceLastLightChange;
 
+// Hours since the light was last turned on or off
+unsigned int hoursSinceLightToggle;
+
 // Hours since last irrigation
 unsigned int hoursSinceLastIrrigation;
 
 // Indicates that the light is on
 bool lightOn;
 
+// Indicates that an active light rule holds the light outputs, and the mask it forces
+bool lightOverridden;
+uint8_t lightOverrideMask;
+
 // Indicates that the GrowBox init message was already sent -> If ESP32 restarts it will be false
 bool sentFirstMessage;
 
@@ -162,13 +397,452 @@ bool autoIrrigate;
 
 bool ventilationOn;
 
+// Idle policies, from the deepest available to none
+enum IdleMode
+{
+  IDLE_AUTO_LIGHT_SLEEP, // automatic light sleep between DTIM beacons (needs CONFIG_PM_ENABLE)
+  IDLE_MODEM_SLEEP,      // radio in modem sleep and CPU at IDLE_CPU_FREQ
+};
+
+// Idle policy selected at boot
+IdleMode idleMode;
+
+// Time in milliseconds of the last Telegram poll
+unsigned long lastPollTime;
+
+// Milliseconds spent working and idling since boot - used for the duty cycle
+uint64_t activeTimeTotal;
+uint64_t idleTimeTotal;
+
+// Groups of commands whose effects overwrite each other - in a backlog only the last of each group runs
+enum CommandGroup
+{
+  GROUP_NONE,
+  GROUP_LIGHT,
+  GROUP_LIGHT_CYCLE,
+  GROUP_IRRIGATE,
+  GROUP_IRRIGATED,
+  GROUP_AUTO_IRRIGATION,
+  GROUP_IRRIGATION_INTERVAL,
+  GROUP_IRRIGATION_TIME,
+  GROUP_VENTILATION,
+  GROUP_OTA,
+};
+
+// Update received from Telegram, only with the fields used by the bot
+struct BotUpdate
+{
+  long updateId;
+  char chatId[24];
+  char text[MAX_COMMAND_LENGTH];
+  long date;
+  // Firmware location of an /ota command: the URL taken out of the text or the file id of the attached document
+  char location[OTA_LOCATION_SIZE];
+};
+
+// Updates of the last getUpdates call
+BotUpdate updates[MAX_UPDATES_PER_POLL];
+
+// Number of updates requested in the next getUpdates call - reduced to 1 when a page does not fit the document
+int updatesPollLimit = MAX_UPDATES_PER_POLL;
+
+// Fixed document for the getUpdates responses (no heap allocation while parsing)
+StaticJsonDocument<UPDATES_DOCUMENT_SIZE> updatesDocument;
+
+// Filter with the fields kept from the getUpdates responses - everything else is skipped on the wire
+StaticJsonDocument<384> updatesFilter;
+
+// Free heap bytes consumed by the last getUpdates call and the most consumed since boot
+uint32_t lastPollHeapUsage;
+uint32_t maxPollHeapUsage;
+
+// Free heap before the current poll
+uint32_t pollHeapBefore;
+
+// Free heap held by the open poll connection (TLS context and record buffers), measured when it connects - the per-poll
+// window only sees the handshakes, this stays allocated between the polls
+uint32_t pollSessionHeap;
+
+// Lowest free heap seen in the current measurement window, and the since-boot low-water mark when the sampling started
+volatile uint32_t heapWindowLow;
+uint32_t heapWindowBootLow;
+
+// Timer that samples the free heap while a measurement window is open
+esp_timer_handle_t heapSamplerTimer;
+
+// Telegram connection of the long polls (the bot messages go through client) - exposes its socket so the idle wait
+// can sleep until the answer arrives
+struct PollClient : public WiFiClientSecure
+{
+  int socket()
+  {
+    return sslclient != nullptr ? sslclient->socket : -1;
+  }
+};
+
+PollClient pollClient;
+
+// Long poll state: no request, or waiting for the answer of the request sent at pollRequestTime
+enum PollState
+{
+  POLL_IDLE,
+  POLL_WAITING,
+};
+
+PollState pollState;
+unsigned long pollRequestTime;
+
+// Offset and limit of the request being waited
+long pollOffset;
+int pollLimit;
+
+// Indicates that the last poll failed - the next one waits BOT_POLL_INTERVAL
+bool pollFailed;
+
+// Body of an HTTP/1.1 response: reads at most Content-Length bytes, so the connection can be reused for the next request
+struct BodyStream : public Stream
+{
+  Stream &source;
+  long remaining;
+
+  BodyStream(Stream &source, long length) : source(source), remaining(length) {}
+
+  int available()
+  {
+    return remaining > 0 ? min((long)source.available(), remaining) : 0;
+  }
+
+  int read()
+  {
+    if (remaining <= 0)
+    {
+      return -1;
+    }
+    int c = source.read();
+    if (c >= 0)
+    {
+      remaining--;
+    }
+    return c;
+  }
+
+  int peek()
+  {
+    return remaining > 0 ? source.peek() : -1;
+  }
+
+  size_t write(uint8_t)
+  {
+    return 0;
+  }
+
+  // Discard what the parser did not read
+  void skip()
+  {
+    char discard[64];
+    while (remaining > 0 && readBytes(discard, min(remaining, (long)sizeof(discard))) > 0)
+    {
+    }
+  }
+};
+
+// Command received while the box was offline
+struct BacklogCommand
+{
+  char text[MAX_COMMAND_LENGTH];
+  long date;
+  char location[OTA_LOCATION_SIZE];
+  bool superseded;
+};
+
+// Commands collected while draining the backlog - kept across the drain attempts until the queue is empty (or the buffer full)
+BacklogCommand backlog[MAX_BACKLOG_COMMANDS];
+int backlogCount;
+
+// Indicates that the pending updates must be drained (and collapsed) before the normal polling
+bool backlogPending;
+
+// Phases of a firmware update
+enum OtaPhase
+{
+  OTA_IDLE,
+  OTA_DOWNLOADING, // image being written in the update partition
+  OTA_INSTALLED,   // image verified and set to boot, waiting for the result of the reboot
+};
+
+// Where the firmware image comes from
+enum OtaSource
+{
+  OTA_SOURCE_URL,      // http(s) URL, usually in the local network
+  OTA_SOURCE_TELEGRAM, // document sent to the bot (the location is its file id)
+};
+
+// Firmware update progress - saved in EEPROM so an interrupted download resumes after a reboot
+struct OtaRecord
+{
+  uint32_t magic;
+  uint8_t phase;
+  uint8_t source;
+  uint8_t bootAttempts; // boots of the new firmware so far (OTA_INSTALLED)
+  uint32_t partition;
+  uint32_t previous; // partition to go back to while the new firmware is not validated, 0 after that
+  uint32_t size;
+  uint32_t written;
+  uint8_t sha256[32];
+  char location[OTA_LOCATION_SIZE];
+};
+
+// Current firmware update
+OtaRecord otaRecord;
+
+// Partition receiving the image
+const esp_partition_t *otaPartition;
+
+// SHA-256 of the image and how many bytes of the partition it covers (behind the written bytes after a reboot)
+mbedtls_sha256_context otaHash;
+uint32_t otaHashed;
+
+// Chunk being received, written to the flash when full
+uint8_t otaChunk[OTA_CHUNK_SIZE];
+int otaChunkLength;
+
+// Download connections - plain HTTP for the local network, TLS for Telegram
+WiFiClient otaPlainClient;
+WiFiClientSecure otaSecureClient;
+WiFiClient *otaClient = &otaPlainClient;
+
+// Download URL - resolved again from the file id for Telegram documents (their links expire)
+char otaUrl[OTA_URL_SIZE];
+
+// Indicates that the image is being received
+bool otaStreaming;
+
+// Time in milliseconds of the last connection attempt and of the last data received
+unsigned long otaLastAttempt;
+unsigned long otaLastData;
+
+// Bytes received since the first connection of the session and when it was made, for the throughput
+uint32_t otaSessionBytes;
+unsigned long otaSessionStart;
+
+// Successful connections of the session
+int otaSessionConnects;
+
+// Last progress quarter reported
+int otaReportedQuarter;
+
+// Bytes written at the last EEPROM save
+uint32_t otaLastSave;
+
+// Keeps the CPU out of the automatic light sleep during the download
+esp_pm_lock_handle_t otaPmLock;
+
+// Indicates that the running firmware is new and still has to reach the bot
+bool otaPendingVerify;
+
+// Indicates that the bootloader rolls the new firmware back (CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE) - otherwise the boot counter of the record does
+bool otaBootloaderRollback;
+
+// Result of the last update, reported once the bot is reachable
+bool otaReportPending;
+MessageId otaReportMessage;
+
 // FUNCTIONS ----------------------------------------------------------------------------------------------------
 
 // Lê as novas mensagens e executa o comando correspondente.
 void handleNewMessages(int numNewMessages);
 
-// Seta as variáveis dos períodos de tempo (luz, irrigação, etc) de acordo com o ciclo atual.
-void setLightIntervals();
+// Executa um comando recebido em uma data (unix time) - backlog indica que foi recebido com a placa offline.
+// location é o local do firmware de um /ota: URL ou documento anexado à mensagem (vazio se não houver).
+void handleCommand(const char *comando, const char *chatId, long date, bool fromBacklog = false, const char *location = "");
+
+// Copia o texto da mensagem para o update. A URL de "/ota URL SHA256" vai para update.location (não cabe no texto do comando).
+void setUpdateText(BotUpdate &update, const char *text);
+
+// Busca uma página de até limit updates (a partir do offset) em updates[] e retorna a quantidade recebida,
+// POLL_FAILED se a consulta falhou ou POLL_RETRY_PAGE se a página deve ser pedida de novo.
+int pollUpdates(long offset, int limit = MAX_UPDATES_PER_POLL);
+
+// Envia a consulta longa quando não há nenhuma pendente e lê a resposta quando ela chega. Retorna os updates recebidos.
+int continuePolling();
+
+// Send a getUpdates request (timeout in seconds, 0 is a short poll) on the poll connection. Returns false if it failed.
+bool sendPollRequest(long offset, int limit, int timeout);
+
+// Read the answer of the pending getUpdates request into updates[]. Returns the number of updates, POLL_FAILED or POLL_RETRY_PAGE.
+int readPollResponse();
+
+// Parse the answer of the pending getUpdates request. Returns the number of updates, POLL_FAILED or POLL_RETRY_PAGE.
+int parsePollResponse();
+
+// Deadline of the poll: when it needs the loop again
+Deadline getPollDeadline();
+
+// Sleep until the pending poll is answered or the timeout (ms) ends
+void waitForPollResponse(unsigned long timeout);
+
+// Create the heap sampler timer
+void initHeapSampler();
+
+// Start a heap measurement window from the current free heap
+void beginHeapWindow();
+
+// Sample the free heap every HEAP_SAMPLE_PERIOD until stopHeapSampling (a window may be sampled in parts)
+void startHeapSampling();
+void stopHeapSampling();
+
+// Heap sampler timer callback
+void sampleHeap(void *arg);
+
+// Create the filter with the fields kept from the getUpdates responses
+void initUpdatesFilter();
+
+// Update the heap consumed by a getUpdates call, given the free heap before the call (measured by the heap window)
+void updatePollHeapUsage(uint32_t heapBefore);
+
+// Busca todas as mensagens pendentes, descarta os comandos redundantes e executa o efeito final.
+void drainBacklog();
+
+// Get the group of a command, used to collapse redundant commands in a backlog
+CommandGroup getCommandGroup(const char *comando);
+
+// Indicates that the command changes an actuator (light, pump, fan) or the firmware right away
+bool isActuatorCommand(const char *comando);
+
+// Indicates that a command sent at the given date (unix time) is too old to be executed
+bool isCommandStale(long date, bool fromBacklog);
+
+// Load the last Telegram update id from EEPROM
+void initLastUpdateId();
+
+// Save the last Telegram update id in EEPROM
+void saveLastUpdateId();
+
+// Troca o perfil de luz atual, recalculando os dados derivados dos passos e salvando na EEPROM.
+void setLightProfile(const LightProfile &profile);
+
+// Monta um perfil com as horas de luz divididas em LED / LED + FS / LED, seguidas das horas de escuro.
+void buildSplitProfile(LightProfile &profile, uint8_t id, int hoursOn);
+
+// Muda o perfil de luz a partir de uma mensagem ("/ciclo auto", "/ciclo custom 20/4", "/ciclo passos 6L 8LF 6L 4-").
+void updateLightProfile(const char *message, const char *chatId);
+
+// Load the light profile from EEPROM (vegetative preset when there is none)
+void initLightProfile();
+
+// Send the current light cycle
+void sendLightCycle(const char *chatId);
+
+// Write the light pins for a step mask (the light relays turn on in LOW)
+void writeLightOutputs(uint8_t mask);
+
+// Hours left until the light is turned on or off by the profile
+int getHoursUntilLightToggle();
+
+// Hours of light per day of a profile
+int getLightHoursOn(const LightProfile &profile);
+
+// Update a signal read by the rules - only a new value marks it for evaluation
+void setSignal(Signal signal, int16_t value);
+
+// Update the time of day signal from the clock
+void updateClockSignal();
+
+// Evaluate the rules whose signals changed and run their actions
+void evaluateRules();
+
+// Apply to an actuator (ventilation or light action pair) the state of the active rule with the highest priority
+void applyRuleActuator(RuleAction onAction, RuleAction offAction);
+
+// Compile a rule text ("temp > 28 e luz = 1 -> ligaventilacao prioridade 2"). Returns false if it is invalid.
+bool compileRule(const char *text, Rule &rule);
+
+// Write the text of a compiled rule
+void formatRule(const Rule &rule, char *text, size_t size);
+
+// Index of a word in a list of names, -1 if it is not there
+int findName(const char *word, const char *const names[], int count);
+
+// Add a rule from a given message ("/regra ...") and save in EEPROM
+void addRule(const char *message, const char *chatId);
+
+// Delete a rule from a given message ("/apagaregra N") and save in EEPROM
+void deleteRule(const char *message, const char *chatId);
+
+// Send the list of rules
+void sendRules(const char *chatId);
+
+// Save the rules in EEPROM
+void saveRules();
+
+// Load the rules from EEPROM
+void initRules();
+
+// Checa se já passou um período do histórico e registra o estado da GrowBox.
+void checkAndRecordHistory();
+
+// Sample of the history, periodsBack periods before the last one. Returns false if there is no such sample.
+bool getHistorySample(int periodsBack, HistorySample &sample);
+
+// Envia o gráfico do histórico das últimas horas da mensagem ("/grafico N").
+void sendChart(const char *message, const char *chatId);
+
+// Upload callbacks of sendPhotoByBinary
+bool isMoreChartDataAvailable();
+byte getNextChartByte();
+byte *getNextChartBuffer();
+int getNextChartBufferLen();
+
+// Inicia, cancela ou mostra a atualização do firmware a partir da mensagem ("/ota SHA256" com a URL ou o documento em location).
+void updateOta(const char *message, const char *chatId, const char *location);
+
+// Load the firmware update record (resuming an interrupted download) and the state of the running firmware
+void initOta();
+
+// Download the next slice of the firmware image
+void continueOta();
+
+// Open the download connection, asking for the image from the bytes already written. Returns false if it failed.
+bool connectOta();
+
+// Write the received chunk in the update partition (and finish the update after the last one)
+void writeOtaChunk();
+
+// Verify the downloaded image, set it to boot and restart
+void finishOta();
+
+// Stop the update and forget its progress
+void abortOta();
+
+// Start a download session from the update record (hash, radio awake)
+void beginOtaSession();
+
+// Release the resources of the download session
+void endOtaSession();
+
+// Save the firmware update record in EEPROM
+void saveOtaRecord();
+
+// Send the download progress
+void sendOtaProgress(const char *chatId);
+
+// Download throughput of the session in bytes per second
+uint32_t getOtaThroughput();
+
+// Validate a new firmware once it reaches the bot (or roll it back) and report the last update
+void checkOtaBoot();
+
+// Boot the firmware that was running before the update. Returns false if it is gone.
+bool rollBackOta();
+
+// Application partition at a flash address, nullptr if there is none
+const esp_partition_t *findAppPartition(uint32_t address);
+
+// Parse a SHA-256 in 64 hex digits. Returns false if it is invalid.
+bool parseSha256(const char *hex, uint8_t *digest);
+
+// Arduino core hook: a new firmware is only marked valid by checkOtaBoot
+extern "C" bool verifyRollbackLater();
 
 // Realiza a irrigação (auto-irrigação ativada) ou envia uma mensagem lembrando da irrigação (auto-irrigação desativada).
 void checkAndIrrigate();
@@ -182,26 +856,41 @@ void checkAndRaiseHours();
 // Conecta na rede WiFi.
 void connectInNetwork();
 
+// Selects the deepest idle policy supported by the current build.
+void initIdlePolicy();
+
+// Milliseconds until the next timed job (poll, hour tick, history sample, rule clock, OTA retry), 0 if one is due now
+unsigned long getNextDeadline();
+
+// Deadline of the next minute boundary, active when a rule reads the time of day
+Deadline getMinuteDeadline();
+
+// Deadline of the firmware download, active while one is pending
+Deadline getOtaDeadline();
+
+// Sleeps (modem/light sleep) until the next deadline and accounts the duty cycle.
+void idleUntilNextDeadline(unsigned long activeStart);
+
 // Envia o menu da luz.
-void showLightOptions(String chatId);
+void showLightOptions(const char *chatId);
 
 // Envia o menu da irrigação.
-void showIrrigationOptions(String chatId, bool lastIrrigationInfo = true, bool nextIrrigationInfo = true);
+void showIrrigationOptions(const char *chatId, bool lastIrrigationInfo = true, bool nextIrrigationInfo = true);
 
-// Muda o estado da luz.
-void changeLightState(int state);
+// Muda o estado da luz. Retorna false se o perfil não tem etapa com a luz nesse estado (ex.: /ciclo custom 24/0).
+bool changeLightState(int state);
 
 // Muda o ciclo.
-void changeLightCycle(String chatId, String cycle);
+void changeLightCycle(const char *chatId, LightProfileId id);
 
 // Realiza uma irrigação.
-void irrigate(String chatId);
+void irrigate(const char *chatId);
 
 // Liga ou desliga a irrigação automática
-void changeAutoIrrigationState(String chatId, bool activate);
+void changeAutoIrrigationState(const char *chatId, bool activate);
 
 // Registra a irrigação.
-void registerIrrigation(String chatId);
+void registerIrrigation(const char *chatId);
 
 // Get the irrigation interval current value
 int getIrrigationInterval();
@@ -216,10 +905,10 @@ void initIrrigationData();
 void writeEEPROM(int address, uint8_t val);
 
 // Update the irrigation interval from a given message
-void updateIrrigationInterval(String message, String chatId);
+void updateIrrigationInterval(const char *message, const char *chatId);
 
 // Update the irrigation time form a given message
-void updateIrrigationTime(String message, String chatId);
+void updateIrrigationTime(const char *message, const char *chatId);
 
 // Get the irrigation time current value
 int getIrrigationTime();
@@ -232,60 +921,118 @@ void setIrrigationTime(int time);
 // message = "/command N"
 //
 // With N being the returned value.
-int getValueFromMessage(String command, String message);
+int getValueFromMessage(const char *command, const char *message);
 
 // Send the grow status message
-void sendStatusInfo(String chatId);
+void sendStatusInfo(const char *chatId);
+
+// Get the light cycle complete name in the current locale
+const char *getLightCycleName(uint8_t id);
+
+// Get a catalog message in the current locale
+const char *getMessage(MessageId id);
+
+// Render a catalog message with its placeholders in messageBuffer, starting at offset. Returns the new length.
+size_t renderMessage(size_t offset, MessageId id, ...);
+
+// Render a catalog message with its placeholders and send it to the chat
+void sendCatalogMessage(const char *chatId, MessageId id, ...);
+
+// Change the messages locale from a given message ("/idioma pt" or "/idioma en") and save in EEPROM
+void updateLocale(const char *message, const char *chatId);
 
-// Get a string with the light cycle complete name
-String getLightCycleName(String cycle, bool withTimes = true);
+// Load the messages locale from EEPROM
+void initLocale();
 
+// Move the schedule to a light step - an active light rule keeps holding the outputs
 void setLightStep(int step);
 
+// Write a light mask to the outputs and notify when the light turns on or off
+void applyLightMask(uint8_t mask);
+
+// Mask of the lights an ON light rule turns on: the first lit step of the profile, or both lights
+uint8_t getRuleLightMask();
+
 void changeVentilationStatus(int status);
 
-void sendVentilationStatus(String chatId);
+// Percentage of the time since boot spent working (not idling)
+float getDutyCycle();
+
+// Start the task watchdog and the stage budget monitor, and load the stall of the last boot
+void initWatchdog();
+
+// Start a loop stage (or restart the current one) and feed the watchdog
+void beginStage(LoopStage stage);
+
+// Monitor timer callback: records a stage over its budget and turns the pump off
+void checkStageBudget(void *arg);
+
+// Send the pending stall report
+void reportStall();
+
+void sendVentilationStatus(const char *chatId);
 
 //-------------------------------------------------------------------------------------------------------------
 
 void setup()
 {
   client.setInsecure();
+  pollClient.setInsecure();
+  pollClient.setHandshakeTimeout(TLS_HANDSHAKE_TIMEOUT);
   EEPROM.begin(512);
+  // Primeiro de tudo: um firmware novo que trave logo no início ainda conta as suas tentativas de boot
+  initOta();
 
   currentLightStep = 0;
-  lightCycle = "veg";
   timeLast = 0;
   timeNow = 0;
   hoursSinceLastLightChange = 0;
+  hoursSinceLightToggle = 0;
   hoursSinceLastIrrigation = 0;
   irrigationTimeInSeconds = 15;
   irrigationIntervalInDays = 5;
   lightOn = true;
+  lightOverridden = false;
   ventilationOn = true;
   sentFirstMessage = false;
   irrigationMessageSent = false;
   autoIrrigate = false;
-
-  setLightIntervals();
+  lastPollTime = 0;
+  pollState = POLL_IDLE;
+  pollFailed = false;
+  activeTimeTotal = 0;
+  idleTimeTotal = 0;
+  backlogPending = true;
+  backlogCount = 0;
+
+  initWatchdog();
+  initHeapSampler();
+  initIdlePolicy();
+  initUpdatesFilter();
+  initLightProfile();
+  initRules();
   initIrrigationData();
+  initLastUpdateId();
+  initLocale();
 
-  // Seta o pino da luz LED como saída e liga (O relé da luz liga em LOW)
+  // Seta os pinos das luzes LED e FS como saída e aplica o primeiro passo do perfil (O relé da luz liga em LOW)
   pinMode(lightPinLED, OUTPUT);
-  digitalWrite(lightPinLED, LOW);
-
-  // Seta o pino da luz FS como saída e desliga (O relé da luz liga em LOW)
   pinMode(lightPinFS, OUTPUT);
-  digitalWrite(lightPinFS, HIGH);
+  writeLightOutputs(lightProfile.steps[0].mask);
+  lightOn = lightProfile.steps[0].mask != 0;
+  setSignal(SIGNAL_LIGHT, lightOn);
 
   // Seta o pino da irrigação como saída e desliga
   pinMode(irrigationPin, OUTPUT);
   digitalWrite(irrigationPin, LOW);
+  setSignal(SIGNAL_PUMP, 0);
 
   // Sets the ventilation control pin as output and sets it to high
   pinMode(coolerPin, OUTPUT);
   digitalWrite(coolerPin, HIGH);
+  setSignal(SIGNAL_VENTILATION, ventilationOn);
 
+  beginStage(STAGE_NETWORK);
   connectInNetwork();
 }
 
@@ -293,26 +1040,57 @@ void setup()
 
 void loop()
 {
+  unsigned long activeStart = millis();
+
   // caso não a placa não esteja conectada a rede WiFi
   if (WiFi.status() != WL_CONNECTED)
   {
+    beginStage(STAGE_NETWORK);
     connectInNetwork();
   }
-  // caso a placa esteja conectada a rede WIfi
+  // caso a placa tenha acabado de (re)conectar, processa as mensagens acumuladas
+  else if (backlogPending)
+  {
+    beginStage(STAGE_COMMANDS);
+    drainBacklog();
+  }
+  // caso a placa esteja conectada a rede WIfi: mantém uma consulta longa pendente e trata as mensagens que chegarem
   else
   {
-    // pega o numero de novas mensagens des de a ultima checagem
-    int numNewMessages = GrowBot.getUpdates(GrowBot.last_message_received + 1);
+    beginStage(STAGE_COMMANDS);
+    int numNewMessages = continuePolling();
     handleNewMessages(numNewMessages);
   }
 
-  setLightIntervals();
+  beginStage(STAGE_LIGHT);
 
   checkAndRaiseHours();
 
+  checkAndRecordHistory();
+
   checkAndChangeLightState();
 
+  beginStage(STAGE_IRRIGATION);
+
   checkAndIrrigate();
+
+  beginStage(STAGE_RULES);
+
+  updateClockSignal();
+
+  evaluateRules();
+
+  reportStall();
+
+  checkOtaBoot();
+
+  beginStage(STAGE_OTA);
+
+  continueOta();
+
+  beginStage(STAGE_IDLE);
+
+  idleUntilNextDeadline(activeStart);
 }
 
 //-------------------------------------------------------------------------------------------------------------
@@ -328,6 +1106,7 @@ void checkAndRaiseHours()
   if (timeNow - timeLast >= ONE_HOUR)
   {
     hoursSinceLastLightChange += 1;
+    hoursSinceLightToggle += 1;
     hoursSinceLastIrrigation += 1;
     timeLast = timeNow;
   }
@@ -336,26 +1115,6 @@ void checkAndRaiseHours()
 
 //-----------------------
 
-void setLightIntervals()
-{
-  int timeOn = 18;
-  if (lightCycle.equalsIgnoreCase("ger"))
-  {
-    timeOn = 16;
-  }
-  else if (lightCycle.equalsIgnoreCase("flor"))
-  {
-    timeOn = 12;
-  }
-  lightPeriodsInHours[0] = int(timeOn / 3);                       // LED ON - FS OFF
-  lightPeriodsInHours[1] = timeOn - (2 * lightPeriodsInHours[0]); // LED ON - FS ON
-  lightPeriodsInHours[2] = lightPeriodsInHours[0];                // LED ON - FS OFF
-  lightPeriodsInHours[3] = 24 - timeOn;                           // LED OFF - FS OFF
-  return;
-}
-
-//-----------------------
-
 void checkAndIrrigate()
 {
   if (hoursSinceLastIrrigation >= irrigationIntervalInDays * 24)
@@ -378,10 +1137,10 @@ void checkAndIrrigate()
 void checkAndChangeLightState()
 {
   // if the current light step period end is reached
-  if (hoursSinceLastLightChange >= lightPeriodsInHours[currentLightStep])
+  if (hoursSinceLastLightChange >= lightProfile.steps[currentLightStep].hours)
   {
-    // go to the net light step (0 -> 1 -> 2 -> 3 -> 0)
-    setLightStep((currentLightStep + 1) % 4);
+    // go to the next light step of the profile (0 -> 1 -> ... -> stepCount - 1 -> 0)
+    setLightStep((currentLightStep + 1) % lightProfile.stepCount);
     hoursSinceLastLightChange = 0;
   }
   return;
@@ -393,96 +1152,14 @@ void handleNewMessages(int numNewMessages)
 {
   if (numNewMessages > 0)
   {
+    // Salva o offset antes de executar: se a placa reiniciar no meio de um comando ele não é executado de novo
+    saveLastUpdateId();
     for (int i = 0; i < numNewMessages; i++)
     {
-      String comando = GrowBot.messages[i].text;
-      String chatId = GrowBot.messages[i].chat_id;
-
-      if (chatId == MY_ID)
+      if (strcmp(updates[i].chatId, MY_ID) == 0)
       {
-        if (comando.equalsIgnoreCase(commands.status))
-        {
-          sendStatusInfo(chatId);
-        }
-        else if (comando.equalsIgnoreCase(commands.lightCycle))
-        {
-          GrowBot.sendMessage(chatId, lightCycle);
-        }
-        else if (comando.equalsIgnoreCase(commands.irrigation))
-        {
-          showIrrigationOptions(chatId, true, autoIrrigate);
-        }
-        else if (comando.equalsIgnoreCase(commands.irrigate))
-        {
-          irrigate(chatId);
-          showIrrigationOptions(chatId, false);
-        }
-        else if (comando.equalsIgnoreCase(commands.irrigated))
-        {
-          registerIrrigation(chatId);
-          showIrrigationOptions(chatId, false);
-        }
-        else if (comando.indexOf(commands.irrigationInterval) >= 0)
-        {
-          updateIrrigationInterval(comando, chatId);
-        }
-        else if (comando.indexOf(commands.irrigationTime) >= 0)
-        {
-          updateIrrigationTime(comando, chatId);
-        }
-        else if (comando.equalsIgnoreCase(commands.autoIrrigationOn) && !autoIrrigate)
-        {
-          changeAutoIrrigationState(chatId, true);
-          showIrrigationOptions(chatId, true, autoIrrigate);
-        }
-        else if (comando.equalsIgnoreCase(commands.autoIrrigationOff) && autoIrrigate)
-        {
-          changeAutoIrrigationState(chatId, false);
-          showIrrigationOptions(chatId, true, autoIrrigate);
-        }
-        else if (comando.equalsIgnoreCase(commands.veg) && lightCycle != "veg")
-        {
-          changeLightCycle(chatId, "veg");
-          showLightOptions(chatId);
-        }
-        else if (comando.equalsIgnoreCase(commands.flor) && lightCycle != "flor")
-        {
-          changeLightCycle(chatId, "flor");
-          showLightOptions(chatId);
-        }
-        else if (comando.equalsIgnoreCase(commands.ger) && lightCycle != "ger")
-        {
-          changeLightCycle(chatId, "ger");
-          showLightOptions(chatId);
-        }
-        else if (comando.equalsIgnoreCase(commands.light))
-        {
-          showLightOptions(chatId);
-        }
-        else if (comando.equalsIgnoreCase(commands.lightOn) && !lightOn)
-        {
-          changeLightState(ON);
-          showLightOptions(chatId);
-        }
-        else if (comando.equalsIgnoreCase(commands.lightOff) && lightOn)
-        {
-          changeLightState(OFF);
-          showLightOptions(chatId);
-        }
-        else if (comando.equalsIgnoreCase(commands.ventilation))
-        {
-          sendVentilationStatus(chatId);
-        }
-        else if (comando.equalsIgnoreCase(commands.ventilationOn))
-        {
-          changeVentilationStatus(ON);
-          sendVentilationStatus(chatId);
-        }
-        else if (comando.equalsIgnoreCase(commands.ventilationOff))
-        {
-          changeVentilationStatus(OFF);
-          sendVentilationStatus(chatId);
-        }
+        beginStage(STAGE_COMMANDS);
+        handleCommand(updates[i].text, updates[i].chatId, updates[i].date, false, updates[i].location);
       }
     }
   }
@@ -491,25 +1168,177 @@ void handleNewMessages(int numNewMessages)
 
 //-----------------------
 
-void connectInNetwork()
+void handleCommand(const char *comando, const char *chatId, long date, bool fromBacklog, const char *location)
 {
-  // Inicia em modo station (mais um dispositivo na rede, o outro modo é o Access Point)
+  if (isActuatorCommand(comando) && isCommandStale(date, fromBacklog))
+  {
+    if (time(nullptr) >= VALID_EPOCH)
+    {
+      sendCatalogMessage(chatId, MSG_STALE_COMMAND, comando, long((time(nullptr) - date) / 60));
+    }
+    else
+    {
+      sendCatalogMessage(chatId, MSG_OFFLINE_COMMAND, comando);
+    }
+    return;
+  }
+
+  if (strcasecmp(comando, commands.status) == 0)
+  {
+    sendStatusInfo(chatId);
+  }
+  else if (strcasecmp(comando, commands.lightCycle) == 0)
+  {
+    sendLightCycle(chatId);
+  }
+  else if (strstr(comando, commands.lightCycle) != nullptr)
+  {
+    updateLightProfile(comando, chatId);
+  }
+  else if (strcasecmp(comando, commands.irrigation) == 0)
+  {
+    showIrrigationOptions(chatId, true, autoIrrigate);
+  }
+  else if (strcasecmp(comando, commands.irrigate) == 0)
+  {
+    irrigate(chatId);
+    showIrrigationOptions(chatId, false);
+  }
+  else if (strcasecmp(comando, commands.irrigated) == 0)
+  {
+    registerIrrigation(chatId);
+    showIrrigationOptions(chatId, false);
+  }
+  else if (strstr(comando, commands.irrigationInterval) != nullptr)
+  {
+    updateIrrigationInterval(comando, chatId);
+  }
+  else if (strstr(comando, commands.irrigationTime) != nullptr)
+  {
+    updateIrrigationTime(comando, chatId);
+  }
+  else if (strcasecmp(comando, commands.autoIrrigationOn) == 0 && !autoIrrigate)
+  {
+    changeAutoIrrigationState(chatId, true);
+    showIrrigationOptions(chatId, true, autoIrrigate);
+  }
+  else if (strcasecmp(comando, commands.autoIrrigationOff) == 0 && autoIrrigate)
+  {
+    changeAutoIrrigationState(chatId, false);
+    showIrrigationOptions(chatId, true, autoIrrigate);
+  }
+  else if (strcasecmp(comando, commands.veg) == 0 && lightProfile.id != PROFILE_VEG)
+  {
+    changeLightCycle(chatId, PROFILE_VEG);
+    showLightOptions(chatId);
+  }
+  else if (strcasecmp(comando, commands.flor) == 0 && lightProfile.id != PROFILE_FLOR)
+  {
+    changeLightCycle(chatId, PROFILE_FLOR);
+    showLightOptions(chatId);
+  }
+  else if (strcasecmp(comando, commands.ger) == 0 && lightProfile.id != PROFILE_GER)
+  {
+    changeLightCycle(chatId, PROFILE_GER);
+    showLightOptions(chatId);
+  }
+  else if (strcasecmp(comando, commands.light) == 0)
+  {
+    showLightOptions(chatId);
+  }
+  else if (strcasecmp(comando, commands.lightOn) == 0 && !lightOn)
+  {
+    if (changeLightState(ON))
+    {
+      showLightOptions(chatId);
+    }
+    else
+    {
+      sendCatalogMessage(chatId, MSG_LIGHT_NO_STEP, getMessage(MSG_ON), commands.lightCycle);
+    }
+  }
+  else if (strcasecmp(comando, commands.lightOff) == 0 && lightOn)
+  {
+    if (changeLightState(OFF))
+    {
+      showLightOptions(chatId);
+    }
+    else
+    {
+      sendCatalogMessage(chatId, MSG_LIGHT_NO_STEP, getMessage(MSG_OFF), commands.lightCycle);
+    }
+  }
+  else if (strcasecmp(comando, commands.ventilation) == 0)
+  {
+    sendVentilationStatus(chatId);
+  }
+  else if (strcasecmp(comando, commands.ventilationOn) == 0)
+  {
+    changeVentilationStatus(ON);
+    sendVentilationStatus(chatId);
+  }
+  else if (strcasecmp(comando, commands.ventilationOff) == 0)
+  {
+    changeVentilationStatus(OFF);
+    sendVentilationStatus(chatId);
+  }
+  else if (strstr(comando, commands.language) != nullptr)
+  {
+    updateLocale(comando, chatId);
+  }
+  else if (strstr(comando, commands.chart) != nullptr)
+  {
+    sendChart(comando, chatId);
+  }
+  else if (strstr(comando, commands.ota) != nullptr)
+  {
+    updateOta(comando, chatId, location);
+  }
+  else if (strcasecmp(comando, commands.rules) == 0)
+  {
+    sendRules(chatId);
+  }
+  else if (strstr(comando, commands.deleteRule) != nullptr)
+  {
+    deleteRule(comando, chatId);
+  }
+  else if (strstr(comando, commands.rule) != nullptr)
+  {
+    addRule(comando, chatId);
+  }
+  return;
+}
+
+//-----------------------
+
+void connectInNetwork()
+{
+  // Inicia em modo station (mais um dispositivo na rede, o outro modo é o Access Point)
   WiFi.mode(WIFI_STA);
+  // Mantém o rádio em modem sleep entre os beacons do roteador (acordado durante o download de uma atualização)
+  WiFi.setSleep(otaRecord.phase != OTA_DOWNLOADING);
   // Conecta na rede com o ssid e senha
   WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
   delay(10000);
   // Se ja tiver conectado
   if (WiFi.status() == WL_CONNECTED)
   {
+    // Sincroniza o relógio (UTC) para saber a idade dos comandos
+    configTzTime(TIMEZONE, "pool.ntp.org");
+    // Mensagens acumuladas enquanto a placa estava offline - a conexão das consultas caiu junto com a rede
+    backlogPending = true;
+    pollClient.stop();
+    pollState = POLL_IDLE;
     // Se ja tiver enviado a primeira mensagem significa que a conexão caiu
     if (sentFirstMessage)
     {
-      GrowBot.sendMessage(MY_ID, "--- Conexão reestabelecida ---");
+      sendCatalogMessage(MY_ID, MSG_CONNECTION_RESTORED);
     }
     // Se não tiver enviado a primeira mensagem significa que acabou de ligar
     else
     {
-      sentFirstMessage = GrowBot.sendMessage(MY_ID, "--- GrowBox ativa ---");
+      renderMessage(0, MSG_GROWBOX_ACTIVE);
+      sentFirstMessage = GrowBot.sendMessage(MY_ID, messageBuffer);
       sendStatusInfo(MY_ID);
     }
   }
@@ -518,51 +1347,50 @@ void connectInNetwork()
 
 //-----------------------
 
-void showLightOptions(String chatId)
+void showLightOptions(const char *chatId)
 {
   if (lightOn)
   {
-    GrowBot.sendMessage(chatId, "Luz ligada ha " + String(hoursSinceLastLightChange) + " horas\nRestam " + String(lightPeriodsInHours[0] - hoursSinceLastLightChange) + " para desligar");
+    sendCatalogMessage(chatId, MSG_LIGHT_ON_SINCE, hoursSinceLightToggle, getHoursUntilLightToggle());
   }
   else
   {
-    GrowBot.sendMessage(chatId, "Luz desligada ha " + String(hoursSinceLastLightChange) + " horas\nRestam " + String(lightPeriodsInHours[1] - hoursSinceLastLightChange) + " para ligar");
+    sendCatalogMessage(chatId, MSG_LIGHT_OFF_SINCE, hoursSinceLightToggle, getHoursUntilLightToggle());
   }
   return;
 }
 
 //-----------------------
 
-void showIrrigationOptions(String chatId, bool lastIrrigationInfo, bool nextIrrigationInfo)
+void showIrrigationOptions(const char *chatId, bool lastIrrigationInfo, bool nextIrrigationInfo)
 {
   if (lastIrrigationInfo)
   {
-    GrowBot.sendMessage(chatId, "Ultima irrigação realizada ha " + String(int(hoursSinceLastIrrigation / 24)) + " dias e " + String(int(hoursSinceLastIrrigation % 24)) + " horas.");
+    sendCatalogMessage(chatId, MSG_LAST_IRRIGATION, hoursSinceLastIrrigation / 24, hoursSinceLastIrrigation % 24);
   }
   if (nextIrrigationInfo)
   {
-    GrowBot.sendMessage(chatId, String(int(((irrigationIntervalInDays * 24) - hoursSinceLastIrrigation) / 24)) + " dias e " + String(int(((irrigationIntervalInDays * 24) - hoursSinceLastIrrigation) % 24)) + " horas restantes até a próxima irrigação.");
+    sendCatalogMessage(chatId, MSG_NEXT_IRRIGATION, int(((irrigationIntervalInDays * 24) - hoursSinceLastIrrigation) / 24), int(((irrigationIntervalInDays * 24) - hoursSinceLastIrrigation) % 24));
   }
   return;
 }
 
 //-----------------------
 
-void changeLightState(int state)
+bool changeLightState(int state)
 {
-  switch (state)
+  // first step of the profile with the lights on (ON) or off (OFF)
+  for (int step = 0; step < lightProfile.stepCount; step++)
   {
-  case ON:
-    setLightStep(0);
-    break;
-  case OFF:
-    setLightStep(3);
-    break;
-  default:
-    break;
+    if ((lightProfile.steps[step].mask != 0) == (state == ON))
+    {
+      setLightStep(step);
+      hoursSinceLastLightChange = 0;
+      return true;
+    }
   }
-  hoursSinceLastLightChange = 0;
-  return;
+  // Nothing changed: the schedule keeps counting the current step
+  return false;
 }
 
 //-----------------------
@@ -570,95 +1398,113 @@ void changeLightState(int state)
 void setLightStep(int step)
 {
   currentLightStep = step;
-  switch (currentLightStep)
+  // The schedule keeps counting its steps under a light rule, and takes the outputs back when it ends
+  applyLightMask(lightOverridden ? lightOverrideMask : lightProfile.steps[currentLightStep].mask);
+}
+
+//-----------------------
+
+void applyLightMask(uint8_t mask)
+{
+  writeLightOutputs(mask);
+
+  if (mask != 0 && !lightOn)
   {
-  case 0:
-    digitalWrite(lightPinLED, LOW);
-    digitalWrite(lightPinFS, HIGH);
-    GrowBot.sendMessage(MY_ID, String("Luz ligada após ") + String(hoursSinceLastLightChange) + String(" horas"));
+    sendCatalogMessage(MY_ID, MSG_LIGHT_TURNED_ON, hoursSinceLightToggle);
+    hoursSinceLightToggle = 0;
     lightOn = true;
-    break;
-  case 1:
-    digitalWrite(lightPinLED, LOW);
-    digitalWrite(lightPinFS, LOW);
-    break;
-  case 2:
-    digitalWrite(lightPinLED, LOW);
-    digitalWrite(lightPinFS, HIGH);
-    break;
-  case 3:
-    digitalWrite(lightPinLED, HIGH);
-    digitalWrite(lightPinFS, HIGH);
-    GrowBot.sendMessage(MY_ID, String("Luz desligada após ") + String(3 * hoursSinceLastLightChange) + String(" horas"));
+    setSignal(SIGNAL_LIGHT, 1);
+  }
+  else if (mask == 0 && lightOn)
+  {
+    sendCatalogMessage(MY_ID, MSG_LIGHT_TURNED_OFF, hoursSinceLightToggle);
+    hoursSinceLightToggle = 0;
     lightOn = false;
-    break;
-  default:
-    break;
+    setSignal(SIGNAL_LIGHT, 0);
+  }
+}
+
+//-----------------------
+
+uint8_t getRuleLightMask()
+{
+  for (int step = 0; step < lightProfile.stepCount; step++)
+  {
+    if (lightProfile.steps[step].mask != 0)
+    {
+      return lightProfile.steps[step].mask;
+    }
   }
+  return LIGHT_LED | LIGHT_FS;
 }
 
 //-----------------------
 
-void changeAutoIrrigationState(String chatId, bool activate)
+void changeAutoIrrigationState(const char *chatId, bool activate)
 {
   if (activate)
   {
     autoIrrigate = true;
     writeEEPROM(autoIrrigationAddress, 1);
-    GrowBot.sendMessage(chatId, "Irrigação automática ligada.");
+    sendCatalogMessage(chatId, MSG_AUTO_IRRIGATION_ON);
   }
   else
   {
     autoIrrigate = false;
     writeEEPROM(autoIrrigationAddress, 0);
-    GrowBot.sendMessage(chatId, "Irrigação automática desligada.");
+    sendCatalogMessage(chatId, MSG_AUTO_IRRIGATION_OFF);
   }
   return;
 }
 
 //-----------------------
 
-void changeLightCycle(String chatId, String cycle)
+void changeLightCycle(const char *chatId, LightProfileId id)
 {
-  if (cycle == "veg")
-  {
-    lightCycle = "veg";
-    GrowBot.sendMessage(chatId, "Ciclo atual: " + getLightCycleName(cycle));
-  }
-  else if (cycle == "ger")
-  {
-    lightCycle = "ger";
-    GrowBot.sendMessage(chatId, "Ciclo atual: " + getLightCycleName(cycle));
-  }
-  else if (cycle == "flor")
-  {
-    lightCycle = "flor";
-    GrowBot.sendMessage(chatId, "Ciclo atual: " + getLightCycleName(cycle));
-  }
-  setLightIntervals();
+  LightProfile profile;
+  buildSplitProfile(profile, id, lightPresets[id].hoursOn);
+  setLightProfile(profile);
+  sendLightCycle(chatId);
   return;
 }
 
 //-----------------------
 
-void irrigate(String chatId)
+void irrigate(const char *chatId)
 {
+  // A irrigação tem a sua própria etapa, reiniciada a cada passo de 1 s: nenhum orçamento depende do tempo de irrigação
+  LoopStage previousStage = (LoopStage)stageMonitor.stage;
+  beginStage(STAGE_PUMP);
+  irrigating = true;
+  pumpRanSinceSample = true;
   digitalWrite(irrigationPin, HIGH);
-  delay(irrigationTimeInSeconds * 1000);
+  unsigned long irrigationStart = millis();
+  setSignal(SIGNAL_PUMP, 0);
+  while (millis() - irrigationStart < irrigationTimeInSeconds * 1000UL)
+  {
+    delay(min(1000UL, irrigationTimeInSeconds * 1000UL - (millis() - irrigationStart)));
+    beginStage(STAGE_PUMP);
+    // As regras que leem o tempo da bomba são avaliadas durante a irrigação
+    setSignal(SIGNAL_PUMP, (millis() - irrigationStart) / 1000);
+    evaluateRules();
+  }
   digitalWrite(irrigationPin, LOW);
+  irrigating = false;
+  setSignal(SIGNAL_PUMP, 0);
   hoursSinceLastIrrigation = 0;
   irrigationMessageSent = false;
-  GrowBot.sendMessage(chatId, "Irrigação realizada.");
+  beginStage(previousStage);
+  sendCatalogMessage(chatId, MSG_IRRIGATION_DONE);
   return;
 }
 
 //-----------------------
 
-void registerIrrigation(String chatId)
+void registerIrrigation(const char *chatId)
 {
   hoursSinceLastIrrigation = 0;
   irrigationMessageSent = false;
-  GrowBot.sendMessage(chatId, "Irrigação registrada.");
+  sendCatalogMessage(chatId, MSG_IRRIGATION_REGISTERED);
   return;
 }
 
@@ -743,53 +1589,48 @@ void writeEEPROM(int address, uint8_t val)
 
 //-----------------------
 
-void updateIrrigationInterval(String message, String chatId)
+void updateIrrigationInterval(const char *message, const char *chatId)
 {
   int interval = getValueFromMessage(commands.irrigationInterval, message);
   if (interval == 0)
   {
-    GrowBot.sendMessage(chatId, "Para modificar o intervalo de irrigação mande a mensagem da forma:\n\n" + String(commands.irrigationInterval) + " N\n\nN é o intervalo de irrigação em dias e deve ser maior que zero.");
+    sendCatalogMessage(chatId, MSG_IRRIGATION_INTERVAL_HELP, commands.irrigationInterval);
     return;
   }
   int oldInterval = irrigationIntervalInDays;
   setIrrigationInterval(interval);
-  GrowBot.sendMessage(chatId, "Intervalo de irrigação alterado de " + String(oldInterval) + " dias para " + String(interval) + " dias.");
+  sendCatalogMessage(chatId, MSG_IRRIGATION_INTERVAL_CHANGED, oldInterval, interval);
   return;
 }
 
 // -----------------------
 
-void updateIrrigationTime(String message, String chatId)
+void updateIrrigationTime(const char *message, const char *chatId)
 {
   int time = getValueFromMessage(commands.irrigationTime, message);
   if (time == 0)
   {
-    GrowBot.sendMessage(chatId, "Para modificar o tempo de irrigação mande a mensagem da forma:\n\n" + String(commands.irrigationTime) + " N\n\nN é o tempo de irrigação em segundos e deve ser maior que zero.");
+    sendCatalogMessage(chatId, MSG_IRRIGATION_TIME_HELP, commands.irrigationTime);
     return;
   }
   int oldTime = irrigationTimeInSeconds;
   setIrrigationTime(time);
-  GrowBot.sendMessage(chatId, "Tempo de irrigação alterado de " + String(oldTime) + " segundos para " + String(time) + " segundos.");
+  sendCatalogMessage(chatId, MSG_IRRIGATION_TIME_CHANGED, oldTime, time);
   return;
 }
 
 //-----------------------
 
-int getValueFromMessage(String command, String message)
+int getValueFromMessage(const char *command, const char *message)
 {
-  String formattedCommand = String(command) + " ";
-  if (message.length() <= formattedCommand.length())
-  {
-    return 0;
-  }
-
-  int index = message.indexOf(formattedCommand);
-  if (index < 0)
+  size_t commandLength = strlen(command);
+  const char *found = strstr(message, command);
+  if (found == nullptr || found[commandLength] != ' ')
   {
     return 0;
   }
 
-  int interval = message.substring(formattedCommand.length()).toInt();
+  long interval = strtol(found + commandLength + 1, nullptr, 10);
   if (interval <= 0)
   {
     return 0;
@@ -800,51 +1641,42 @@ int getValueFromMessage(String command, String message)
 
 //-----------------------
 
-void sendStatusInfo(String chatId)
+void sendStatusInfo(const char *chatId)
 {
-  String message = "Status:\n\n";
+  size_t length = 0;
 
   // light status
-  message += "LUZ \xF0\x9F\x92\xA1 \n";
-  message += "- Ciclo de luz: " + getLightCycleName(lightCycle) + ".\n";
-  message += "- Status da luz: " + String(lightOn ? "ligada" : "desligada") + ".\n";
-  message += "- Etapa de iluminação: " + String(currentLightStep) + ".\n";
-  message += "- Tempo dês de a ultima mudança na luz: " + String(hoursSinceLastLightChange) + " horas.\n";
+  length = renderMessage(length, MSG_STATUS_LIGHT, getLightCycleName(lightProfile.id), lightHoursOn, 24 - lightHoursOn,
+                         getMessage(lightOn ? MSG_ON : MSG_OFF), currentLightStep, hoursSinceLastLightChange);
   // add new light status here
-  message += "\n";
 
   // irrigation status
-  message += "IRRIGAÇÃO \xF0\x9F\x9A\xBF \n";
-  message += "- Intervalo entre irrigações: " + String(irrigationIntervalInDays) + " dias.\n";
-  message += "- Tempo de irrigação: " + String(irrigationTimeInSeconds) + " segundos.\n";
-  message += "- Status da auto-irrigação: " + String(autoIrrigate ? "ligada" : "desligada") + ".\n";
-  message += "- Tempo dês de a ultima irrigação: " + String(int(hoursSinceLastIrrigation / 24)) + " dias e " + String(int(hoursSinceLastIrrigation % 24)) + " horas.\n";
+  length = renderMessage(length, MSG_STATUS_IRRIGATION, irrigationIntervalInDays, irrigationTimeInSeconds, getMessage(autoIrrigate ? MSG_ON : MSG_OFF),
+                         hoursSinceLastIrrigation / 24, hoursSinceLastIrrigation % 24);
   // add new irrigation status here
-  message += "\n";
 
-  message += "VENTILAÇÃO \xF0\x9F\x86\x92 \n";
-  message += "- Status da ventilação: " + String(ventilationOn ? "ligada" : "desligada") + ".\n";
+  length = renderMessage(length, MSG_STATUS_VENTILATION, getMessage(ventilationOn ? MSG_ON : MSG_OFF));
 
-  GrowBot.sendMessage(chatId, message);
+  length = renderMessage(length, MSG_STATUS_ENERGY, getMessage(idleMode == IDLE_AUTO_LIGHT_SLEEP ? MSG_IDLE_LIGHT_SLEEP : MSG_IDLE_MODEM_SLEEP), getDutyCycle(),
+                         (unsigned int)lastPollHeapUsage, (unsigned int)maxPollHeapUsage, (unsigned int)(pollClient.connected() ? pollSessionHeap : 0),
+                         (unsigned int)ESP.getMinFreeHeap());
+
+  GrowBot.sendMessage(chatId, messageBuffer);
 }
 
 //-----------------------
 
-String getLightCycleName(String cycle, bool withTimes)
+const char *getLightCycleName(uint8_t id)
 {
-  if (cycle == "veg")
-  {
-    return "Vegetativo" + String(withTimes ? " (18/6)" : "");
-  }
-  else if (cycle == "ger")
+  if (id < PROFILE_CUSTOM)
   {
-    return "Germinação" + String(withTimes ? " (16/8)" : "");
+    return getMessage(lightPresets[id].label);
   }
-  else if (cycle == "flor")
+  else if (id == PROFILE_CUSTOM)
   {
-    return "Floração" + String(withTimes ? " (12/12)" : "");
+    return getMessage(MSG_CYCLE_CUSTOM);
   }
-  return "Unknown";
+  return getMessage(MSG_CYCLE_UNKNOWN);
 }
 
 //-----------------------
@@ -864,12 +1696,2125 @@ void changeVentilationStatus(int status)
   default:
     break;
   }
+  setSignal(SIGNAL_VENTILATION, ventilationOn);
+}
+
+//-----------------------
+
+void sendVentilationStatus(const char *chatId)
+{
+  sendCatalogMessage(chatId, MSG_VENTILATION_STATUS, getMessage(ventilationOn ? MSG_ON : MSG_OFF));
+}
+
+//-----------------------
+
+void initIdlePolicy()
+{
+  // Automatic light sleep keeps the WiFi association (wakes on DTIM beacons and timers - the board has no input pins to wake on)
+  // but only works when the framework is built with CONFIG_PM_ENABLE and tickless idle.
+  esp_pm_config_esp32_t pmConfig;
+  pmConfig.max_freq_mhz = ACTIVE_CPU_FREQ;
+  pmConfig.min_freq_mhz = IDLE_CPU_FREQ;
+  pmConfig.light_sleep_enable = true;
+  if (esp_pm_configure(&pmConfig) == ESP_OK)
+  {
+    idleMode = IDLE_AUTO_LIGHT_SLEEP;
+  }
+  // Stock Arduino framework: modem sleep and a slower CPU clock while waiting
+  else
+  {
+    idleMode = IDLE_MODEM_SLEEP;
+  }
+}
+
+//-----------------------
+
+unsigned long getNextDeadline()
+{
+  if (WiFi.status() != WL_CONNECTED)
+  {
+    return 0;
+  }
+
+  const Deadline deadlines[] = {
+      getPollDeadline(),
+      {true, timeLast, ONE_HOUR},
+      {true, lastHistorySample, HISTORY_PERIOD},
+      getMinuteDeadline(),
+      getOtaDeadline(),
+  };
+  return findNextDeadline(millis(), deadlines, sizeof(deadlines) / sizeof(deadlines[0]), MAX_IDLE_TIME);
+}
+
+//-----------------------
+
+Deadline getMinuteDeadline()
+{
+  Deadline deadline = {false, 0, RULE_CLOCK_PERIOD};
+  for (int i = 0; i < ruleEngine.ruleCount; i++)
+  {
+    if (ruleEngine.inputMasks[i] & (1 << SIGNAL_TIME))
+    {
+      deadline.active = true;
+    }
+  }
+
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  if (now.tv_sec < VALID_EPOCH)
+  {
+    deadline.active = false;
+    return deadline;
+  }
+  // Time zones are whole minutes: the local minute starts with the UTC one
+  deadline.start = millis() - ((now.tv_sec % 60) * 1000 + now.tv_usec / 1000);
+  return deadline;
+}
+
+//-----------------------
+
+Deadline getOtaDeadline()
+{
+  Deadline deadline = {otaRecord.phase == OTA_DOWNLOADING, otaLastAttempt, OTA_RETRY_INTERVAL};
+  // No idling while the image streams or is rehashed, only until the next connection attempt
+  if (otaStreaming || otaHashed < otaRecord.written || otaLastAttempt == 0)
+  {
+    deadline.start = millis();
+    deadline.interval = 0;
+  }
+  return deadline;
+}
+
+//-----------------------
+
+void idleUntilNextDeadline(unsigned long activeStart)
+{
+  unsigned long idleStart = millis();
+  activeTimeTotal += idleStart - activeStart;
+
+  unsigned long deadline = getNextDeadline();
+  if (deadline == 0)
+  {
+    return;
+  }
+
+  // Blocking the loop task lets FreeRTOS idle the CPU (light sleep when enabled) until the timer fires or the poll is answered
+  if (idleMode == IDLE_MODEM_SLEEP)
+  {
+    setCpuFrequencyMhz(IDLE_CPU_FREQ);
+  }
+  waitForPollResponse(deadline);
+  if (idleMode == IDLE_MODEM_SLEEP)
+  {
+    setCpuFrequencyMhz(ACTIVE_CPU_FREQ);
+  }
+
+  idleTimeTotal += millis() - idleStart;
+}
+
+//-----------------------
+
+float getDutyCycle()
+{
+  uint64_t total = activeTimeTotal + idleTimeTotal;
+  if (total == 0)
+  {
+    return 100.0;
+  }
+  return 100.0 * activeTimeTotal / total;
+}
+
+//-----------------------
+
+void setUpdateText(BotUpdate &update, const char *text)
+{
+  const char *command = strstr(text, commands.ota);
+  const char *url = nullptr;
+  if (command != nullptr)
+  {
+    command += strlen(commands.ota);
+    url = command + strspn(command, " ");
+  }
+  if (url == nullptr || (strncmp(url, "http://", 7) != 0 && strncmp(url, "https://", 8) != 0))
+  {
+    strlcpy(update.text, text, MAX_COMMAND_LENGTH);
+    return;
+  }
+
+  // Uma URL que não cabe fica de fora: sem local o comando responde com a ajuda, em vez de baixar de uma URL cortada
+  size_t urlLength = strcspn(url, " ");
+  update.location[0] = '\0';
+  if (urlLength < OTA_LOCATION_SIZE)
+  {
+    memcpy(update.location, url, urlLength);
+    update.location[urlLength] = '\0';
+  }
+  snprintf(update.text, MAX_COMMAND_LENGTH, "%.*s%s", (int)(command - text), text, url + urlLength);
+}
+
+//-----------------------
+
+void drainBacklog()
+{
+  // Consulta anterior falhou: tenta de novo depois de BOT_POLL_INTERVAL, sem passar para as consultas normais
+  if (pollFailed && millis() - lastPollTime < BOT_POLL_INTERVAL)
+  {
+    return;
+  }
+
+  // Espera alguns segundos pela sincronização do relógio para poder julgar a idade dos comandos
+  struct tm timeInfo;
+  getLocalTime(&timeInfo, 5000);
+
+  // Busca as páginas de mensagens pendentes até esvaziar a fila (ou encher o buffer). Cada página cabe no espaço livre do
+  // buffer: o offset avança sobre a página inteira, então nenhum update recebido pode ficar de fora.
+  while (backlogCount < MAX_BACKLOG_COMMANDS)
+  {
+    // A espera do NTP e cada página têm o orçamento inteiro do estágio
+    beginStage(STAGE_COMMANDS);
+    int numNewMessages = pollUpdates(GrowBot.last_message_received + 1, MAX_BACKLOG_COMMANDS - backlogCount);
+    if (numNewMessages == POLL_RETRY_PAGE)
+    {
+      continue;
+    }
+    // Falha não é fila vazia: os comandos já recebidos esperam a próxima tentativa, e o backlog continua pendente
+    if (numNewMessages == POLL_FAILED)
+    {
+      return;
+    }
+    if (numNewMessages == 0)
+    {
+      break;
+    }
+    for (int i = 0; i < numNewMessages; i++)
+    {
+      if (strcmp(updates[i].chatId, MY_ID) == 0)
+      {
+        BacklogCommand &command = backlog[backlogCount];
+        strlcpy(command.text, updates[i].text, MAX_COMMAND_LENGTH);
+        command.date = updates[i].date;
+        strlcpy(command.location, updates[i].location, OTA_LOCATION_SIZE);
+        command.superseded = false;
+        backlogCount++;
+      }
+    }
+  }
+  int count = backlogCount;
+  backlogCount = 0;
+
+  // Salva o offset antes de executar: se a placa reiniciar no meio do backlog ele não é executado de novo
+  saveLastUpdateId();
+
+  // Um comando é descartado se um posterior do mesmo grupo (ou idêntico) sobrescreve o seu efeito
+  for (int i = 0; i < count; i++)
+  {
+    CommandGroup group = getCommandGroup(backlog[i].text);
+    for (int j = i + 1; j < count && !backlog[i].superseded; j++)
+    {
+      if ((group != GROUP_NONE && getCommandGroup(backlog[j].text) == group) || strcasecmp(backlog[j].text, backlog[i].text) == 0)
+      {
+        backlog[i].superseded = true;
+      }
+    }
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    if (!backlog[i].superseded)
+    {
+      beginStage(STAGE_COMMANDS);
+      handleCommand(backlog[i].text, MY_ID, backlog[i].date, true, backlog[i].location);
+    }
+  }
+
+  // Com o buffer cheio ainda podem existir mensagens pendentes
+  backlogPending = count >= MAX_BACKLOG_COMMANDS;
 }
 
 //-----------------------
 
-void sendVentilationStatus(String chatId)
+CommandGroup getCommandGroup(const char *comando)
 {
-  String message = "Ventilação " + String(ventilationOn ? "ligada" : "desligada") + ".";
-  GrowBot.sendMessage(chatId, message);
-}
\ No newline at end of file
+  if (strcasecmp(comando, commands.lightOn) == 0 || strcasecmp(comando, commands.lightOff) == 0)
+  {
+    return GROUP_LIGHT;
+  }
+  else if (strcasecmp(comando, commands.ger) == 0 || strcasecmp(comando, commands.veg) == 0 || strcasecmp(comando, commands.flor) == 0 ||
+           (strstr(comando, commands.lightCycle) != nullptr && strcasecmp(comando, commands.lightCycle) != 0))
+  {
+    return GROUP_LIGHT_CYCLE;
+  }
+  else if (strcasecmp(comando, commands.irrigate) == 0)
+  {
+    return GROUP_IRRIGATE;
+  }
+  else if (strcasecmp(comando, commands.irrigated) == 0)
+  {
+    return GROUP_IRRIGATED;
+  }
+  else if (strcasecmp(comando, commands.autoIrrigationOn) == 0 || strcasecmp(comando, commands.autoIrrigationOff) == 0)
+  {
+    return GROUP_AUTO_IRRIGATION;
+  }
+  else if (strstr(comando, commands.irrigationInterval) != nullptr)
+  {
+    return GROUP_IRRIGATION_INTERVAL;
+  }
+  else if (strstr(comando, commands.irrigationTime) != nullptr)
+  {
+    return GROUP_IRRIGATION_TIME;
+  }
+  else if (strcasecmp(comando, commands.ventilationOn) == 0 || strcasecmp(comando, commands.ventilationOff) == 0)
+  {
+    return GROUP_VENTILATION;
+  }
+  else if (strstr(comando, commands.ota) != nullptr && strcasecmp(comando, commands.ota) != 0)
+  {
+    // "/ota" sozinho só mostra o progresso: não substitui nem é substituído por uma atualização
+    return GROUP_OTA;
+  }
+  return GROUP_NONE;
+}
+
+//-----------------------
+
+bool isActuatorCommand(const char *comando)
+{
+  CommandGroup group = getCommandGroup(comando);
+  return group == GROUP_LIGHT || group == GROUP_LIGHT_CYCLE || group == GROUP_IRRIGATE || group == GROUP_VENTILATION || group == GROUP_OTA;
+}
+
+//-----------------------
+
+bool isCommandStale(long date, bool fromBacklog)
+{
+  time_t now = time(nullptr);
+  // Sem relógio sincronizado não é possível saber a idade: só confia nos comandos recebidos online
+  if (now < VALID_EPOCH)
+  {
+    return fromBacklog;
+  }
+  return now - date > MAX_COMMAND_AGE;
+}
+
+//-----------------------
+
+void initLastUpdateId()
+{
+  long lastUpdateId = 0;
+  if (EEPROM.read(lastUpdateIdFlagAddress) == 1)
+  {
+    EEPROM.get(lastUpdateIdAddress, lastUpdateId);
+  }
+  GrowBot.last_message_received = lastUpdateId;
+}
+
+//-----------------------
+
+void saveLastUpdateId()
+{
+  long savedUpdateId = 0;
+  EEPROM.get(lastUpdateIdAddress, savedUpdateId);
+  if (EEPROM.read(lastUpdateIdFlagAddress) == 1 && savedUpdateId == GrowBot.last_message_received)
+  {
+    return;
+  }
+  EEPROM.put(lastUpdateIdAddress, GrowBot.last_message_received);
+  EEPROM.write(lastUpdateIdFlagAddress, 1);
+  EEPROM.commit();
+}
+
+//-----------------------
+
+void initUpdatesFilter()
+{
+  // The first element of the filter array applies to every update in the result
+  updatesFilter["result"][0]["update_id"] = true;
+  updatesFilter["result"][0]["message"]["chat"]["id"] = true;
+  updatesFilter["result"][0]["message"]["text"] = true;
+  updatesFilter["result"][0]["message"]["date"] = true;
+  updatesFilter["result"][0]["message"]["caption"] = true;
+  updatesFilter["result"][0]["message"]["document"]["file_id"] = true;
+  updatesFilter["result"][0]["callback_query"]["data"] = true;
+  updatesFilter["result"][0]["callback_query"]["message"]["chat"]["id"] = true;
+}
+
+//-----------------------
+
+void updatePollHeapUsage(uint32_t heapBefore)
+{
+  // Lowest free heap during this poll only (TLS handshake on reconnects, record buffers, JSON document)
+  uint32_t heapLow = heapWindowLow;
+  lastPollHeapUsage = heapBefore > heapLow ? heapBefore - heapLow : 0;
+  maxPollHeapUsage = max(maxPollHeapUsage, lastPollHeapUsage);
+}
+
+//-----------------------
+
+void initHeapSampler()
+{
+  esp_timer_create_args_t samplerArgs = {};
+  samplerArgs.callback = &sampleHeap;
+  samplerArgs.name = "heap_sampler";
+  esp_timer_create(&samplerArgs, &heapSamplerTimer);
+}
+
+//-----------------------
+
+void beginHeapWindow()
+{
+  heapWindowLow = ESP.getFreeHeap();
+}
+
+//-----------------------
+
+void startHeapSampling()
+{
+  heapWindowBootLow = ESP.getMinFreeHeap();
+  sampleHeap(nullptr);
+  // Only runs while a window is sampled: does not keep the CPU out of light sleep while idle
+  esp_timer_start_periodic(heapSamplerTimer, HEAP_SAMPLE_PERIOD);
+}
+
+//-----------------------
+
+void stopHeapSampling()
+{
+  esp_timer_stop(heapSamplerTimer);
+  sampleHeap(nullptr);
+  // If the since-boot low-water mark dropped while sampling, the new mark was reached inside this window:
+  // it is exact even for allocations shorter than the sampling period
+  uint32_t bootLow = ESP.getMinFreeHeap();
+  if (bootLow < heapWindowBootLow && bootLow < heapWindowLow)
+  {
+    heapWindowLow = bootLow;
+  }
+}
+
+//-----------------------
+
+void sampleHeap(void *arg)
+{
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap < heapWindowLow)
+  {
+    heapWindowLow = freeHeap;
+  }
+}
+
+//-----------------------
+
+#ifndef LIBRARY_GET_UPDATES
+
+int pollUpdates(long offset, int limit)
+{
+  // Consulta curta (timeout 0), esperando a resposta: usada para esvaziar o backlog
+  if (!sendPollRequest(offset, limit, 0))
+  {
+    return POLL_FAILED;
+  }
+  waitForPollResponse(POLL_RESPONSE_TIMEOUT);
+  if (pollClient.available() <= 0)
+  {
+    pollClient.stop();
+    pollState = POLL_IDLE;
+    pollFailed = true;
+    lastPollTime = millis();
+    return POLL_FAILED;
+  }
+  return readPollResponse();
+}
+
+//-----------------------
+
+int continuePolling()
+{
+  if (pollState == POLL_WAITING)
+  {
+    if (pollClient.available() > 0)
+    {
+      return max(readPollResponse(), 0);
+    }
+    // Conexão perdida ou resposta atrasada demais: tenta de novo depois de BOT_POLL_INTERVAL
+    if (!pollClient.connected() || millis() - pollRequestTime >= LONG_POLL_TIMEOUT * 1000UL + LONG_POLL_MARGIN)
+    {
+      pollClient.stop();
+      pollState = POLL_IDLE;
+      pollFailed = true;
+      lastPollTime = millis();
+    }
+    return 0;
+  }
+
+  if (pollFailed && millis() - lastPollTime < BOT_POLL_INTERVAL)
+  {
+    return 0;
+  }
+  sendPollRequest(GrowBot.last_message_received + 1, MAX_UPDATES_PER_POLL, LONG_POLL_TIMEOUT);
+  return 0;
+}
+
+//-----------------------
+
+bool sendPollRequest(long offset, int limit, int timeout)
+{
+  pollHeapBefore = ESP.getFreeHeap();
+  beginHeapWindow();
+  startHeapSampling();
+
+  // A conexão fica aberta entre as consultas (HTTP/1.1 keep-alive): o handshake TLS só acontece ao reconectar
+  if (!pollClient.connected())
+  {
+    pollClient.stop();
+    uint32_t heapBeforeConnect = ESP.getFreeHeap();
+    if (!pollClient.connect(TELEGRAM_HOST, TELEGRAM_SSL_PORT))
+    {
+      stopHeapSampling();
+      pollFailed = true;
+      lastPollTime = millis();
+      return false;
+    }
+    uint32_t heapConnected = ESP.getFreeHeap();
+    pollSessionHeap = heapBeforeConnect > heapConnected ? heapBeforeConnect - heapConnected : 0;
+  }
+
+  char request[256];
+  snprintf(request, sizeof(request),
+           "GET /bot" TOKEN "/getUpdates?limit=%d&offset=%ld&timeout=%d&allowed_updates=%%5B%%22message%%22%%2C%%22callback_query%%22%%5D HTTP/1.1\r\n"
+           "Host: " TELEGRAM_HOST "\r\n"
+           "Connection: keep-alive\r\n\r\n",
+           min(updatesPollLimit, limit), offset, timeout);
+  pollClient.print(request);
+  stopHeapSampling();
+
+  pollOffset = offset;
+  pollLimit = limit;
+  pollState = POLL_WAITING;
+  pollRequestTime = millis();
+  return true;
+}
+
+//-----------------------
+
+int readPollResponse()
+{
+  startHeapSampling();
+  int count = parsePollResponse();
+  stopHeapSampling();
+  updatePollHeapUsage(pollHeapBefore);
+
+  pollState = POLL_IDLE;
+  pollFailed = count == POLL_FAILED;
+  lastPollTime = millis();
+  return count;
+}
+
+//-----------------------
+
+int parsePollResponse()
+{
+  char line[64] = {0};
+  pollClient.readBytesUntil('\n', line, sizeof(line) - 1);
+  bool ok = strstr(line, " 200 ") != nullptr;
+
+  // O corpo é lido pelo Content-Length para a conexão continuar utilizável (sem chunked encoding)
+  long contentLength = -1;
+  bool keepAlive = true;
+  while (true)
+  {
+    size_t length = pollClient.readBytesUntil('\n', line, sizeof(line) - 1);
+    line[length] = '\0';
+    if (length <= 1)
+    {
+      break;
+    }
+    if (strncasecmp(line, "Content-Length:", 15) == 0)
+    {
+      contentLength = strtol(line + 15, nullptr, 10);
+    }
+    else if (strncasecmp(line, "Connection: close", 17) == 0 || strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+    {
+      keepAlive = false;
+    }
+  }
+  if (!ok || contentLength < 0 || !keepAlive)
+  {
+    pollClient.stop();
+    return POLL_FAILED;
+  }
+
+  BodyStream body(pollClient, contentLength);
+  DeserializationError error = deserializeJson(updatesDocument, body, DeserializationOption::Filter(updatesFilter));
+  body.skip();
+
+  JsonArray result = updatesDocument["result"];
+  if (error == DeserializationError::NoMemory)
+  {
+    // A página não coube no documento: busca um update por vez e pula o que sozinho não cabe
+    if (updatesPollLimit > 1)
+    {
+      updatesPollLimit = 1;
+      return POLL_RETRY_PAGE;
+    }
+    if (result.size() > 0 && result[0]["update_id"].as<long>() >= pollOffset)
+    {
+      GrowBot.last_message_received = result[0]["update_id"].as<long>();
+      return POLL_RETRY_PAGE;
+    }
+    // Nem o id do update coube: sem progresso possível, conta como falha
+    return POLL_FAILED;
+  }
+  if (error)
+  {
+    pollClient.stop();
+    return POLL_FAILED;
+  }
+  updatesPollLimit = MAX_UPDATES_PER_POLL;
+
+  int count = 0;
+  for (JsonObject update : result)
+  {
+    if (count >= pollLimit)
+    {
+      break;
+    }
+    BotUpdate &botUpdate = updates[count];
+    botUpdate.updateId = update["update_id"];
+    GrowBot.last_message_received = botUpdate.updateId;
+
+    JsonObject message = update["message"];
+    if (!message.isNull())
+    {
+      snprintf(botUpdate.chatId, sizeof(botUpdate.chatId), "%lld", message["chat"]["id"].as<long long>());
+      // Documentos: a legenda funciona como o texto do comando ("/ota SHA256" com o firmware anexado)
+      strlcpy(botUpdate.location, message["document"]["file_id"] | "", OTA_LOCATION_SIZE);
+      setUpdateText(botUpdate, message["text"] | (message["caption"] | ""));
+      botUpdate.date = message["date"];
+    }
+    else
+    {
+      // Botões inline: os dados do botão funcionam como o texto do comando, enviado agora
+      JsonObject callbackQuery = update["callback_query"];
+      snprintf(botUpdate.chatId, sizeof(botUpdate.chatId), "%lld", callbackQuery["message"]["chat"]["id"].as<long long>());
+      botUpdate.location[0] = '\0';
+      strlcpy(botUpdate.text, callbackQuery["data"] | "", MAX_COMMAND_LENGTH);
+      botUpdate.date = time(nullptr);
+    }
+    count++;
+  }
+  return count;
+}
+
+//-----------------------
+
+Deadline getPollDeadline()
+{
+  unsigned long now = millis();
+  if (pollState == POLL_WAITING)
+  {
+    // The answer itself wakes the idle wait (waitForPollResponse)
+    Deadline deadline = {true, pollRequestTime, LONG_POLL_TIMEOUT * 1000UL + LONG_POLL_MARGIN};
+    if (pollClient.available() > 0)
+    {
+      deadline.start = now;
+      deadline.interval = 0;
+    }
+    return deadline;
+  }
+  if (pollFailed)
+  {
+    return {true, lastPollTime, BOT_POLL_INTERVAL};
+  }
+  return {true, now, 0};
+}
+
+//-----------------------
+
+void waitForPollResponse(unsigned long timeout)
+{
+  int socket = pollClient.socket();
+  // Bytes already decrypted by mbedTLS do not show in the socket
+  if (pollState != POLL_WAITING || pollClient.available() > 0 || socket < 0)
+  {
+    if (pollState != POLL_WAITING || socket < 0)
+    {
+      delay(timeout);
+    }
+    return;
+  }
+
+  // select() blocks the loop task until the socket is readable: the CPU idles (or light sleeps) meanwhile
+  fd_set readSet;
+  FD_ZERO(&readSet);
+  FD_SET(socket, &readSet);
+  struct timeval waitTime;
+  waitTime.tv_sec = timeout / 1000;
+  waitTime.tv_usec = (timeout % 1000) * 1000;
+  select(socket + 1, &readSet, nullptr, nullptr, &waitTime);
+}
+
+#else
+
+// Caminho da biblioteca, mantido para comparar o heap por consulta (compilar com -D LIBRARY_GET_UPDATES). As consultas
+// usam a conexão do bot (client), sem sessão própria: o custo residente se compara pelo menor heap livre do /status
+int pollUpdates(long offset, int limit)
+{
+  uint32_t heapBefore = ESP.getFreeHeap();
+  beginHeapWindow();
+  startHeapSampling();
+  int numNewMessages = GrowBot.getUpdates(offset);
+  stopHeapSampling();
+  updatePollHeapUsage(heapBefore);
+  lastPollTime = millis();
+
+  // A biblioteca devolve 0 tanto para a fila vazia quanto para as falhas: neste caminho o backlog não as distingue
+  int count = 0;
+  // getUpdates da biblioteca pede HANDLE_MESSAGES updates por vez (1 por padrão), nunca mais que o limite
+  for (int i = 0; i < numNewMessages && count < limit; i++, count++)
+  {
+    updates[count].updateId = GrowBot.messages[i].update_id;
+    strlcpy(updates[count].chatId, GrowBot.messages[i].chat_id.c_str(), sizeof(updates[count].chatId));
+    // A biblioteca não expõe o file id dos documentos: neste caminho só há atualização por URL
+    updates[count].location[0] = '\0';
+    setUpdateText(updates[count], GrowBot.messages[i].text.c_str());
+    updates[count].date = GrowBot.messages[i].date.toInt();
+  }
+  return count;
+}
+
+//-----------------------
+
+int continuePolling()
+{
+  // Consultas curtas a cada BOT_POLL_INTERVAL
+  if (lastPollTime != 0 && millis() - lastPollTime < BOT_POLL_INTERVAL)
+  {
+    return 0;
+  }
+  int numNewMessages = pollUpdates(GrowBot.last_message_received + 1);
+  lastPollTime = millis();
+  return numNewMessages;
+}
+
+//-----------------------
+
+Deadline getPollDeadline()
+{
+  return {true, lastPollTime, lastPollTime == 0 ? 0UL : BOT_POLL_INTERVAL};
+}
+
+//-----------------------
+
+void waitForPollResponse(unsigned long timeout)
+{
+  delay(timeout);
+}
+
+#endif
+
+//-----------------------
+
+const char *getMessage(MessageId id)
+{
+  return getCatalogText(currentLocale, id);
+}
+
+//-----------------------
+
+size_t renderMessage(size_t offset, MessageId id, ...)
+{
+  va_list args;
+  va_start(args, id);
+  size_t length = renderCatalogText(messageBuffer, MESSAGE_BUFFER_SIZE, offset, currentLocale, id, args);
+  va_end(args);
+  return length;
+}
+
+//-----------------------
+
+void sendCatalogMessage(const char *chatId, MessageId id, ...)
+{
+  va_list args;
+  va_start(args, id);
+  renderCatalogText(messageBuffer, MESSAGE_BUFFER_SIZE, 0, currentLocale, id, args);
+  va_end(args);
+
+  GrowBot.sendMessage(chatId, messageBuffer);
+}
+
+//-----------------------
+
+void updateLocale(const char *message, const char *chatId)
+{
+  size_t commandLength = strlen(commands.language);
+  const char *found = strstr(message, commands.language);
+  const char *code = found[commandLength] == ' ' ? found + commandLength + 1 : "";
+
+  if (strcasecmp(code, "pt") == 0 || strcasecmp(code, "pt-br") == 0)
+  {
+    currentLocale = LOCALE_PT_BR;
+  }
+  else if (strcasecmp(code, "en") == 0)
+  {
+    currentLocale = LOCALE_EN;
+  }
+  else
+  {
+    sendCatalogMessage(chatId, MSG_LOCALE_HELP, commands.language, commands.language);
+    return;
+  }
+
+  writeEEPROM(localeAddress, currentLocale);
+  sendCatalogMessage(chatId, MSG_LOCALE_CHANGED);
+}
+
+//-----------------------
+
+void initLocale()
+{
+  uint8_t locale = EEPROM.read(localeAddress);
+  // Erased EEPROM reads 0xFF: falls back to Portuguese
+  currentLocale = locale < LOCALE_COUNT ? (Locale)locale : LOCALE_PT_BR;
+}
+
+//-----------------------
+
+void initWatchdog()
+{
+  // A stall record is only valid after a reset that kept the RTC memory
+  if (stallRecord.magic == STALL_RECORD_MAGIC && esp_reset_reason() != ESP_RST_POWERON)
+  {
+    stallReportPending = true;
+    stallRebooted = esp_reset_reason() == ESP_RST_TASK_WDT;
+  }
+  else
+  {
+    stallRecord.magic = 0;
+    stallReportPending = false;
+    stallRebooted = false;
+  }
+
+  initStageMonitor(stageMonitor, stageBudgets, STAGE_COUNT, WATCHDOG_TIMEOUT * 1000UL);
+
+  // Panics (and reboots) when the loop task is not fed within WATCHDOG_TIMEOUT
+  esp_task_wdt_init(WATCHDOG_TIMEOUT, true);
+  esp_task_wdt_add(NULL);
+
+  esp_timer_create_args_t monitorArgs = {};
+  monitorArgs.callback = &checkStageBudget;
+  monitorArgs.name = "stage_monitor";
+  esp_timer_create(&monitorArgs, &stageMonitorTimer);
+  beginStage(STAGE_NETWORK);
+}
+
+//-----------------------
+
+void beginStage(LoopStage stage)
+{
+  portENTER_CRITICAL(&stageMonitorLock);
+  bool endedLate = beginMonitoredStage(stageMonitor, stage, millis());
+  portEXIT_CRITICAL(&stageMonitorLock);
+  if (endedLate)
+  {
+    // The stage finished after all: report it on the next loop
+    stallReportPending = true;
+  }
+
+  // Wakes up only when the budget ends, so idle stages can light sleep. If the timer callback re-armed it
+  // meanwhile the start fails, and that check re-arms it for this stage.
+  esp_timer_stop(stageMonitorTimer);
+  esp_timer_start_once(stageMonitorTimer, (getStageBudget(stageMonitor, stage) + 1) * 1000ULL);
+  esp_task_wdt_reset();
+}
+
+//-----------------------
+
+void checkStageBudget(void *arg)
+{
+  uint32_t nextCheck;
+  portENTER_CRITICAL(&stageMonitorLock);
+  StageCheck check = checkMonitoredStage(stageMonitor, millis(), nextCheck);
+  int stage = stageMonitor.stage;
+  uint32_t elapsed = millis() - stageMonitor.start;
+  portEXIT_CRITICAL(&stageMonitorLock);
+
+  if (check == STAGE_OVERRUN)
+  {
+    // Fail-safe: the pump must never stay on while the loop is stuck
+    digitalWrite(irrigationPin, LOW);
+    stallRecord.stage = stage;
+    stallRecord.budget = getStageBudget(stageMonitor, stage);
+    stallRecord.magic = STALL_RECORD_MAGIC;
+  }
+  if (check != STAGE_ON_TIME)
+  {
+    // Keeps the stall length up to date until the stage ends or the watchdog resets the board
+    stallRecord.elapsed = elapsed;
+  }
+  esp_timer_start_once(stageMonitorTimer, nextCheck * 1000ULL);
+}
+
+//-----------------------
+
+void reportStall()
+{
+  if (!stallReportPending || WiFi.status() != WL_CONNECTED)
+  {
+    return;
+  }
+  MessageId stageName = (MessageId)(MSG_STAGE_NETWORK + min(stallRecord.stage, (uint32_t)STAGE_COUNT - 1));
+  sendCatalogMessage(MY_ID, stallRebooted ? MSG_STALL_REBOOT : MSG_STALL_DETECTED, getMessage(stageName), (unsigned int)stallRecord.elapsed, (unsigned int)stallRecord.budget);
+  stallRecord.magic = 0;
+  stallReportPending = false;
+  stallRebooted = false;
+}
+
+//-----------------------
+
+void setLightProfile(const LightProfile &profile)
+{
+  lightProfile = profile;
+
+  // Derived data is recomputed only here, when the profile changes
+  lightHoursOn = getLightHoursOn(lightProfile);
+
+  // The new profile starts from its first step (an ON light rule keeps on the lights of the new profile)
+  if (lightOverridden && lightOverrideMask != 0)
+  {
+    lightOverrideMask = getRuleLightMask();
+  }
+  hoursSinceLastLightChange = 0;
+  setLightStep(0);
+
+  // Packed as one byte per step: hours in the 6 high bits, light mask in the 2 low bits
+  EEPROM.write(lightProfileAddress, lightProfile.id);
+  EEPROM.write(lightProfileAddress + 1, lightProfile.stepCount);
+  for (int step = 0; step < lightProfile.stepCount; step++)
+  {
+    EEPROM.write(lightProfileAddress + 2 + step, (lightProfile.steps[step].hours << 2) | (lightProfile.steps[step].mask & 0x03));
+  }
+  EEPROM.write(lightProfileFlagAddress, 1);
+  EEPROM.commit();
+}
+
+//-----------------------
+
+void buildSplitProfile(LightProfile &profile, uint8_t id, int hoursOn)
+{
+  int third = hoursOn / 3;
+  profile.id = id;
+  profile.stepCount = 0;
+
+  if (third > 0)
+  {
+    profile.steps[profile.stepCount++] = {(uint8_t)third, LIGHT_LED};                             // LED ON - FS OFF
+    profile.steps[profile.stepCount++] = {(uint8_t)(hoursOn - 2 * third), LIGHT_LED | LIGHT_FS}; // LED ON - FS ON
+    profile.steps[profile.stepCount++] = {(uint8_t)third, LIGHT_LED};                             // LED ON - FS OFF
+  }
+  else if (hoursOn > 0)
+  {
+    profile.steps[profile.stepCount++] = {(uint8_t)hoursOn, LIGHT_LED};
+  }
+  if (hoursOn < 24)
+  {
+    profile.steps[profile.stepCount++] = {(uint8_t)(24 - hoursOn), 0}; // LED OFF - FS OFF
+  }
+}
+
+//-----------------------
+
+void updateLightProfile(const char *message, const char *chatId)
+{
+  // Copia os argumentos depois do comando para separar as palavras
+  char arguments[MAX_COMMAND_LENGTH];
+  strlcpy(arguments, strstr(message, commands.lightCycle) + strlen(commands.lightCycle), MAX_COMMAND_LENGTH);
+
+  char *context;
+  char *word = strtok_r(arguments, " ", &context);
+  LightProfile profile;
+  bool valid = false;
+
+  for (int id = 0; word != nullptr && id < PROFILE_CUSTOM; id++)
+  {
+    if (strcasecmp(word, lightPresets[id].name) == 0)
+    {
+      buildSplitProfile(profile, id, lightPresets[id].hoursOn);
+      valid = true;
+    }
+  }
+
+  if (word != nullptr && strcasecmp(word, "custom") == 0)
+  {
+    // "/ciclo custom H/D"
+    char *hours = strtok_r(nullptr, " ", &context);
+    int hoursOn = -1;
+    int hoursOff = -1;
+    if (hours != nullptr && sscanf(hours, "%d/%d", &hoursOn, &hoursOff) == 2 && hoursOn >= 0 && hoursOff >= 0 && hoursOn + hoursOff == 24)
+    {
+      buildSplitProfile(profile, PROFILE_CUSTOM, hoursOn);
+      valid = true;
+    }
+  }
+  else if (word != nullptr && strcasecmp(word, "passos") == 0)
+  {
+    // "/ciclo passos 6L 8LF 6L 4-"
+    int totalHours = 0;
+    profile.id = PROFILE_CUSTOM;
+    profile.stepCount = 0;
+    valid = true;
+    for (char *step = strtok_r(nullptr, " ", &context); step != nullptr && valid; step = strtok_r(nullptr, " ", &context))
+    {
+      char *lights;
+      long hours = strtol(step, &lights, 10);
+      uint8_t mask = 0;
+      for (; *lights != '\0' && valid; lights++)
+      {
+        if (*lights == 'L' || *lights == 'l')
+        {
+          mask |= LIGHT_LED;
+        }
+        else if (*lights == 'F' || *lights == 'f')
+        {
+          mask |= LIGHT_FS;
+        }
+        else if (*lights != '-')
+        {
+          valid = false;
+        }
+      }
+      if (hours <= 0 || hours > 24 || profile.stepCount >= MAX_LIGHT_STEPS)
+      {
+        valid = false;
+      }
+      else
+      {
+        profile.steps[profile.stepCount++] = {(uint8_t)hours, mask};
+        totalHours += hours;
+      }
+    }
+    valid = valid && profile.stepCount > 0 && totalHours == 24;
+  }
+
+  if (!valid)
+  {
+    sendCatalogMessage(chatId, MSG_CYCLE_HELP, commands.lightCycle, commands.lightCycle, commands.lightCycle, MAX_LIGHT_STEPS);
+    return;
+  }
+
+  setLightProfile(profile);
+  sendLightCycle(chatId);
+}
+
+//-----------------------
+
+void initLightProfile()
+{
+  int totalHours = 0;
+  lightProfile.id = EEPROM.read(lightProfileAddress);
+  lightProfile.stepCount = EEPROM.read(lightProfileAddress + 1);
+  for (int step = 0; step < lightProfile.stepCount && step < MAX_LIGHT_STEPS; step++)
+  {
+    uint8_t packed = EEPROM.read(lightProfileAddress + 2 + step);
+    lightProfile.steps[step] = {(uint8_t)(packed >> 2), (uint8_t)(packed & 0x03)};
+    totalHours += lightProfile.steps[step].hours;
+  }
+
+  // Sem perfil válido salvo, começa no vegetativo
+  if (EEPROM.read(lightProfileFlagAddress) != 1 || lightProfile.id >= PROFILE_COUNT || lightProfile.stepCount == 0 ||
+      lightProfile.stepCount > MAX_LIGHT_STEPS || totalHours != 24)
+  {
+    buildSplitProfile(lightProfile, PROFILE_VEG, lightPresets[PROFILE_VEG].hoursOn);
+  }
+  lightHoursOn = getLightHoursOn(lightProfile);
+}
+
+//-----------------------
+
+void sendLightCycle(const char *chatId)
+{
+  sendCatalogMessage(chatId, MSG_CURRENT_CYCLE, getLightCycleName(lightProfile.id), lightHoursOn, 24 - lightHoursOn);
+}
+
+//-----------------------
+
+void writeLightOutputs(uint8_t mask)
+{
+  digitalWrite(lightPinLED, (mask & LIGHT_LED) ? LOW : HIGH);
+  digitalWrite(lightPinFS, (mask & LIGHT_FS) ? LOW : HIGH);
+}
+
+//-----------------------
+
+int getHoursUntilLightToggle()
+{
+  bool on = lightProfile.steps[currentLightStep].mask != 0;
+  int hours = lightProfile.steps[currentLightStep].hours - hoursSinceLastLightChange;
+  for (int i = 1; i < lightProfile.stepCount; i++)
+  {
+    const LightStep &step = lightProfile.steps[(currentLightStep + i) % lightProfile.stepCount];
+    if ((step.mask != 0) != on)
+    {
+      break;
+    }
+    hours += step.hours;
+  }
+  return max(hours, 0);
+}
+
+//-----------------------
+
+int getLightHoursOn(const LightProfile &profile)
+{
+  int hoursOn = 0;
+  for (int step = 0; step < profile.stepCount; step++)
+  {
+    if (profile.steps[step].mask != 0)
+    {
+      hoursOn += profile.steps[step].hours;
+    }
+  }
+  return hoursOn;
+}
+
+//-----------------------
+
+void setSignal(Signal signal, int16_t value)
+{
+  setRuleSignal(ruleEngine, signal, value);
+}
+
+//-----------------------
+
+void updateClockSignal()
+{
+  time_t now = time(nullptr);
+  if (now < VALID_EPOCH)
+  {
+    return;
+  }
+  struct tm localTime;
+  localtime_r(&now, &localTime);
+  setSignal(SIGNAL_TIME, localTime.tm_hour * 60 + localTime.tm_min);
+}
+
+//-----------------------
+
+void evaluateRules()
+{
+  RulePass pass;
+  if (evaluatingRules || !runRulePass(ruleEngine, pass))
+  {
+    return;
+  }
+  evaluatingRules = true;
+
+  for (int i = 0; i < ruleEngine.ruleCount; i++)
+  {
+    if (pass.notifications & (1 << i))
+    {
+      char text[MAX_COMMAND_LENGTH];
+      formatRule(ruleEngine.rules[i], text, sizeof(text));
+      sendCatalogMessage(MY_ID, MSG_RULE_TRIGGERED, i + 1, text);
+    }
+  }
+  if (pass.ventilationChanged)
+  {
+    applyRuleActuator(ACTION_VENTILATION_ON, ACTION_VENTILATION_OFF);
+  }
+  if (pass.lightChanged)
+  {
+    applyRuleActuator(ACTION_LIGHT_ON, ACTION_LIGHT_OFF);
+  }
+
+  evaluatingRules = false;
+
+  // Depois da passada: as avaliações de cada segundo da irrigação disparam as regras que leem a bomba.
+  // Regras avaliadas durante uma irrigação não iniciam outra.
+  if (pass.irrigate && !irrigating)
+  {
+    irrigate(MY_ID);
+  }
+}
+
+//-----------------------
+
+void applyRuleActuator(RuleAction onAction, RuleAction offAction)
+{
+  // The active rule with the highest priority wins (the first one on a tie)
+  int winner = findActuatorRule(ruleEngine, onAction, offAction);
+  // Without an active rule the ventilation keeps its state (manual control) and the light goes back to the schedule
+  if (winner < 0)
+  {
+    if (onAction == ACTION_LIGHT_ON && lightOverridden)
+    {
+      lightOverridden = false;
+      setLightStep(currentLightStep);
+    }
+    return;
+  }
+
+  bool turnOn = ruleEngine.rules[winner].action == onAction;
+  if (onAction == ACTION_VENTILATION_ON && turnOn != ventilationOn)
+  {
+    changeVentilationStatus(turnOn ? ON : OFF);
+    sendVentilationStatus(MY_ID);
+  }
+  else if (onAction == ACTION_LIGHT_ON)
+  {
+    // The rule holds the outputs while it is active: the schedule steps (and /ligaluz, /desligaluz) do not undo it
+    lightOverridden = true;
+    lightOverrideMask = turnOn ? getRuleLightMask() : 0;
+    applyLightMask(lightOverrideMask);
+  }
+}
+
+//-----------------------
+
+bool compileRule(const char *text, Rule &rule)
+{
+  char buffer[MAX_COMMAND_LENGTH];
+  strlcpy(buffer, text, sizeof(buffer));
+
+  char *context;
+  char *word = strtok_r(buffer, " ", &context);
+  rule.conditionCount = 0;
+  rule.priority = 1;
+
+  // SIGNAL OP VALUE [e SIGNAL OP VALUE]...
+  while (true)
+  {
+    if (word == nullptr || rule.conditionCount >= MAX_RULE_CONDITIONS)
+    {
+      return false;
+    }
+    RuleCondition &condition = rule.conditions[rule.conditionCount++];
+
+    int signal = findName(word, signalNames, SIGNAL_COUNT);
+    word = strtok_r(nullptr, " ", &context);
+    int op = word != nullptr ? findName(word, operatorNames, OP_COUNT) : -1;
+    word = strtok_r(nullptr, " ", &context);
+    if (signal < 0 || op < 0 || word == nullptr)
+    {
+      return false;
+    }
+    condition.signal = signal;
+    condition.op = op;
+
+    if (signal == SIGNAL_TIME)
+    {
+      int hour, minute;
+      if (sscanf(word, "%d:%d", &hour, &minute) != 2 || hour < 0 || hour > 23 || minute < 0 || minute > 59)
+      {
+        return false;
+      }
+      condition.value = hour * 60 + minute;
+    }
+    else
+    {
+      char *end;
+      long value = strtol(word, &end, 10);
+      if (*end != '\0' || value < INT16_MIN || value > INT16_MAX)
+      {
+        return false;
+      }
+      condition.value = value;
+    }
+
+    word = strtok_r(nullptr, " ", &context);
+    if (word == nullptr || strcasecmp(word, "e") != 0)
+    {
+      break;
+    }
+    word = strtok_r(nullptr, " ", &context);
+  }
+
+  // -> ACTION [prioridade N]
+  if (word == nullptr || strcmp(word, "->") != 0)
+  {
+    return false;
+  }
+  word = strtok_r(nullptr, " ", &context);
+  int action = word != nullptr ? findName(word[0] == '/' ? word + 1 : word, actionNames, ACTION_COUNT) : -1;
+  if (action < 0)
+  {
+    return false;
+  }
+  rule.action = action;
+
+  word = strtok_r(nullptr, " ", &context);
+  if (word != nullptr && strcasecmp(word, "prioridade") == 0)
+  {
+    word = strtok_r(nullptr, " ", &context);
+    long priority = word != nullptr ? strtol(word, nullptr, 10) : 0;
+    if (priority < 1 || priority > 255)
+    {
+      return false;
+    }
+    rule.priority = priority;
+    word = strtok_r(nullptr, " ", &context);
+  }
+  return word == nullptr;
+}
+
+//-----------------------
+
+void formatRule(const Rule &rule, char *text, size_t size)
+{
+  size_t length = 0;
+  for (int i = 0; i < rule.conditionCount && length < size; i++)
+  {
+    const RuleCondition &condition = rule.conditions[i];
+    const char *separator = i > 0 ? " e " : "";
+    if (condition.signal == SIGNAL_TIME)
+    {
+      length += snprintf(text + length, size - length, "%s%s %s %02d:%02d", separator, signalNames[condition.signal], operatorNames[condition.op],
+                         condition.value / 60, condition.value % 60);
+    }
+    else
+    {
+      length += snprintf(text + length, size - length, "%s%s %s %d", separator, signalNames[condition.signal], operatorNames[condition.op], condition.value);
+    }
+  }
+  if (length < size)
+  {
+    snprintf(text + length, size - length, " -> %s prioridade %d", actionNames[rule.action], rule.priority);
+  }
+}
+
+//-----------------------
+
+int findName(const char *word, const char *const names[], int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    if (strcasecmp(word, names[i]) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+//-----------------------
+
+void addRule(const char *message, const char *chatId)
+{
+  if (ruleEngine.ruleCount >= MAX_RULES)
+  {
+    sendCatalogMessage(chatId, MSG_RULES_FULL, MAX_RULES, commands.deleteRule);
+    return;
+  }
+
+  Rule rule;
+  if (!compileRule(strstr(message, commands.rule) + strlen(commands.rule), rule))
+  {
+    sendCatalogMessage(chatId, MSG_RULE_HELP, commands.rule, commands.rule, MAX_RULES);
+    return;
+  }
+
+  // The new rule is evaluated with the current signals on the next loop
+  appendRule(ruleEngine, rule);
+  saveRules();
+
+  char text[MAX_COMMAND_LENGTH];
+  formatRule(rule, text, sizeof(text));
+  sendCatalogMessage(chatId, MSG_RULE_ADDED, ruleEngine.ruleCount, text);
+}
+
+//-----------------------
+
+void deleteRule(const char *message, const char *chatId)
+{
+  int number = getValueFromMessage(commands.deleteRule, message);
+  if (number <= 0 || number > ruleEngine.ruleCount)
+  {
+    sendCatalogMessage(chatId, MSG_RULE_DELETE_HELP, commands.deleteRule, commands.rules);
+    return;
+  }
+
+  bool wasActive = removeRule(ruleEngine, number - 1);
+  saveRules();
+
+  // An active rule may have been holding an actuator: the remaining rules (or the light schedule) take over
+  if (wasActive)
+  {
+    applyRuleActuator(ACTION_VENTILATION_ON, ACTION_VENTILATION_OFF);
+    applyRuleActuator(ACTION_LIGHT_ON, ACTION_LIGHT_OFF);
+  }
+  sendCatalogMessage(chatId, MSG_RULE_DELETED, number);
+}
+
+//-----------------------
+
+void sendRules(const char *chatId)
+{
+  if (ruleEngine.ruleCount == 0)
+  {
+    sendCatalogMessage(chatId, MSG_RULES_EMPTY);
+    return;
+  }
+
+  size_t length = renderMessage(0, MSG_RULES_HEADER);
+  for (int i = 0; i < ruleEngine.ruleCount; i++)
+  {
+    char text[MAX_COMMAND_LENGTH];
+    formatRule(ruleEngine.rules[i], text, sizeof(text));
+    length = renderMessage(length, MSG_RULE_LINE, i + 1, text);
+  }
+  GrowBot.sendMessage(chatId, messageBuffer);
+}
+
+//-----------------------
+
+void saveRules()
+{
+  EEPROM.write(ruleCountAddress, ruleEngine.ruleCount);
+  for (int i = 0; i < ruleEngine.ruleCount; i++)
+  {
+    EEPROM.put(rulesAddress + i * sizeof(Rule), ruleEngine.rules[i]);
+  }
+  EEPROM.commit();
+}
+
+//-----------------------
+
+void initRules()
+{
+  initRuleEngine(ruleEngine);
+  int ruleCount = EEPROM.read(ruleCountAddress);
+  // Erased EEPROM reads 0xFF
+  if (ruleCount > MAX_RULES)
+  {
+    ruleCount = 0;
+  }
+
+  for (int i = 0; i < ruleCount; i++)
+  {
+    Rule rule;
+    EEPROM.get(rulesAddress + i * sizeof(Rule), rule);
+    if (isValidRule(rule))
+    {
+      appendRule(ruleEngine, rule);
+    }
+  }
+}
+
+//-----------------------
+
+void checkAndRecordHistory()
+{
+  if (millis() - lastHistorySample < HISTORY_PERIOD)
+  {
+    return;
+  }
+  lastHistorySample = millis();
+
+  HistorySample &sample = history[historyHead];
+  sample.flags = lightOverridden ? lightOverrideMask : lightProfile.steps[currentLightStep].mask;
+  if (ventilationOn)
+  {
+    sample.flags |= HISTORY_VENTILATION;
+  }
+  if (pumpRanSinceSample || irrigating)
+  {
+    sample.flags |= HISTORY_PUMP;
+  }
+  if (ruleEngine.knownSignals & (1 << SIGNAL_TEMPERATURE))
+  {
+    sample.flags |= HISTORY_TEMPERATURE;
+    sample.temperature = constrain(ruleEngine.signalValues[SIGNAL_TEMPERATURE], INT8_MIN, INT8_MAX);
+  }
+  if (ruleEngine.knownSignals & (1 << SIGNAL_SOIL))
+  {
+    sample.flags |= HISTORY_SOIL;
+    sample.soil = constrain(ruleEngine.signalValues[SIGNAL_SOIL], 0, 100);
+  }
+  pumpRanSinceSample = false;
+
+  historyHead = (historyHead + 1) % HISTORY_SAMPLES;
+  historyCount = min(historyCount + 1, HISTORY_SAMPLES);
+}
+
+//-----------------------
+
+bool getHistorySample(int periodsBack, HistorySample &sample)
+{
+  if (periodsBack < 0 || periodsBack >= historyCount)
+  {
+    return false;
+  }
+  sample = history[(historyHead - 1 - periodsBack + HISTORY_SAMPLES) % HISTORY_SAMPLES];
+  return true;
+}
+
+//-----------------------
+
+void sendChart(const char *message, const char *chatId)
+{
+  int hours = 24;
+  if (strcasecmp(message, commands.chart) != 0)
+  {
+    hours = getValueFromMessage(commands.chart, message);
+  }
+  if (hours <= 0 || hours > HISTORY_HOURS)
+  {
+    sendCatalogMessage(chatId, MSG_CHART_HELP, commands.chart, HISTORY_HOURS);
+    return;
+  }
+
+  beginChart(chartEncoder, getHistorySample, hours, HISTORY_SAMPLES_PER_HOUR);
+  chartEncodeTime = 0;
+
+  // Same heap window as the getUpdates polls: only this upload, including the TLS buffers
+  uint32_t heapBefore = ESP.getFreeHeap();
+  beginHeapWindow();
+  startHeapSampling();
+  String response = GrowBot.sendPhotoByBinary(chatId, "image/png", getChartFileSize(), isMoreChartDataAvailable, getNextChartByte,
+                                              getNextChartBuffer, getNextChartBufferLen);
+  stopHeapSampling();
+  uint32_t heapLow = heapWindowLow;
+
+  if (response.indexOf("\"ok\":true") < 0)
+  {
+    sendCatalogMessage(chatId, MSG_CHART_FAILED);
+    return;
+  }
+  sendCatalogMessage(chatId, MSG_CHART_LEGEND, hours, CHART_MAX_TEMPERATURE, (unsigned int)(chartEncodeTime / 1000), (unsigned int)getChartFileSize(),
+                     (unsigned int)(heapBefore > heapLow ? heapBefore - heapLow : 0));
+}
+
+//-----------------------
+
+bool isMoreChartDataAvailable()
+{
+  if (chartEncoder.position >= chartEncoder.length && chartEncoder.part != PART_DONE)
+  {
+    unsigned long start = micros();
+    encodeNextChartPart(chartEncoder);
+    chartEncodeTime += micros() - start;
+  }
+  return chartEncoder.position < chartEncoder.length;
+}
+
+//-----------------------
+
+byte getNextChartByte()
+{
+  if (!isMoreChartDataAvailable())
+  {
+    return 0;
+  }
+  return chartEncoder.buffer[chartEncoder.position++];
+}
+
+//-----------------------
+
+byte *getNextChartBuffer()
+{
+  // Each part is handed over whole: the buffer does not depend on the length call, which may be evaluated first
+  return chartEncoder.buffer;
+}
+
+//-----------------------
+
+int getNextChartBufferLen()
+{
+  chartEncoder.position = chartEncoder.length;
+  return chartEncoder.length;
+}
+
+//-----------------------
+
+void updateOta(const char *message, const char *chatId, const char *location)
+{
+  // Argumentos depois do comando: "SHA256" (a URL já foi separada em location), "cancelar" ou nenhum
+  char arguments[MAX_COMMAND_LENGTH];
+  strlcpy(arguments, strstr(message, commands.ota) + strlen(commands.ota), sizeof(arguments));
+  char *context;
+  char *first = strtok_r(arguments, " ", &context);
+  char *second = strtok_r(nullptr, " ", &context);
+
+  if (first == nullptr && otaRecord.phase == OTA_DOWNLOADING)
+  {
+    sendOtaProgress(chatId);
+    return;
+  }
+  if (first != nullptr && strcasecmp(first, "cancelar") == 0 && otaRecord.phase == OTA_DOWNLOADING)
+  {
+    abortOta();
+    sendCatalogMessage(chatId, MSG_OTA_CANCELLED);
+    return;
+  }
+  if (first != nullptr && otaRecord.phase == OTA_DOWNLOADING)
+  {
+    sendCatalogMessage(chatId, MSG_OTA_BUSY, commands.ota);
+    return;
+  }
+
+  OtaRecord record = {};
+  if (first == nullptr || second != nullptr || !parseSha256(first, record.sha256) || location[0] == '\0')
+  {
+    sendCatalogMessage(chatId, MSG_OTA_HELP, commands.ota, commands.ota, commands.ota, commands.ota);
+    return;
+  }
+
+  // Partição OTA inativa (ota_0/ota_1 da tabela padrão)
+  otaPartition = esp_ota_get_next_update_partition(nullptr);
+  if (otaPartition == nullptr)
+  {
+    sendCatalogMessage(chatId, MSG_OTA_NO_PARTITION);
+    return;
+  }
+
+  record.magic = OTA_RECORD_MAGIC;
+  record.phase = OTA_DOWNLOADING;
+  record.source = strncmp(location, "http", 4) == 0 ? OTA_SOURCE_URL : OTA_SOURCE_TELEGRAM;
+  record.partition = otaPartition->address;
+  strlcpy(record.location, location, OTA_LOCATION_SIZE);
+  otaRecord = record;
+  saveOtaRecord();
+
+  beginOtaSession();
+  sendCatalogMessage(chatId, MSG_OTA_STARTED, commands.ota);
+}
+
+//-----------------------
+
+void initOta()
+{
+  otaSecureClient.setInsecure();
+  // A stuck TLS handshake ends well inside the STAGE_OTA budget
+  otaSecureClient.setHandshakeTimeout(TLS_HANDSHAKE_TIMEOUT);
+
+  // Only exists with CONFIG_PM_ENABLE - without it there is no automatic light sleep to hold back
+  if (esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "ota", &otaPmLock) != ESP_OK)
+  {
+    otaPmLock = nullptr;
+  }
+
+  // A new firmware boots pending verification when the bootloader has rollback enabled
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  esp_ota_img_states_t state;
+  otaBootloaderRollback = esp_ota_get_state_partition(running, &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY;
+  otaPendingVerify = otaBootloaderRollback;
+  otaReportPending = false;
+
+  EEPROM.get(otaAddress, otaRecord);
+  if (otaRecord.magic != OTA_RECORD_MAGIC)
+  {
+    otaRecord.phase = OTA_IDLE;
+    return;
+  }
+
+  if (otaRecord.phase == OTA_INSTALLED)
+  {
+    otaReportPending = true;
+    // Reboot after an update: the new image runs (the record is cleared once it is validated) or the bootloader went back to the old one
+    if (running->address == otaRecord.partition)
+    {
+      otaReportMessage = MSG_OTA_UPDATED;
+      if (otaBootloaderRollback || otaRecord.previous == 0)
+      {
+        return;
+      }
+      // Stock bootloader (no app rollback): the record counts the boots, and a firmware that keeps resetting goes back
+      otaPendingVerify = true;
+      otaRecord.bootAttempts++;
+      saveOtaRecord();
+      if (otaRecord.bootAttempts > OTA_MAX_BOOT_ATTEMPTS)
+      {
+        // Só retorna se o firmware anterior não existe mais: checkOtaBoot aceita o novo no fim do prazo
+        rollBackOta();
+      }
+      return;
+    }
+    otaReportMessage = MSG_OTA_ROLLED_BACK;
+  }
+  else
+  {
+    // Download interrupted by a reboot: resumes from the last saved progress, unless the partitions changed
+    otaPartition = esp_ota_get_next_update_partition(nullptr);
+    if (otaRecord.phase == OTA_DOWNLOADING && otaPartition != nullptr && otaPartition->address == otaRecord.partition &&
+        otaRecord.written <= otaRecord.size && otaRecord.size <= otaPartition->size)
+    {
+      beginOtaSession();
+      return;
+    }
+  }
+
+  otaRecord.magic = 0;
+  otaRecord.phase = OTA_IDLE;
+  saveOtaRecord();
+}
+
+//-----------------------
+
+void continueOta()
+{
+  if (otaRecord.phase != OTA_DOWNLOADING || WiFi.status() != WL_CONNECTED)
+  {
+    return;
+  }
+  unsigned long sliceStart = millis();
+
+  // Download retomado: o hash primeiro alcança os bytes gravados antes de reiniciar
+  while (otaHashed < otaRecord.written)
+  {
+    if (millis() - sliceStart >= OTA_SLICE_TIME)
+    {
+      return;
+    }
+    uint32_t length = min((uint32_t)OTA_CHUNK_SIZE, otaRecord.written - otaHashed);
+    esp_partition_read(otaPartition, otaHashed, otaChunk, length);
+    mbedtls_sha256_update_ret(&otaHash, otaChunk, length);
+    otaHashed += length;
+  }
+
+  if (!otaStreaming)
+  {
+    if (otaLastAttempt != 0 && millis() - otaLastAttempt < OTA_RETRY_INTERVAL)
+    {
+      return;
+    }
+    otaLastAttempt = millis();
+    if (!connectOta())
+    {
+      otaClient->stop();
+      // Links de arquivos do Telegram expiram: resolve de novo na próxima tentativa
+      if (otaRecord.source == OTA_SOURCE_TELEGRAM)
+      {
+        otaUrl[0] = '\0';
+      }
+      return;
+    }
+  }
+
+  while (otaRecord.phase == OTA_DOWNLOADING && millis() - sliceStart < OTA_SLICE_TIME)
+  {
+    int available = otaClient->available();
+    if (available <= 0)
+    {
+      // Conexão fechada ou parada: reconecta depois a partir dos bytes já gravados
+      if (!otaClient->connected() || millis() - otaLastData >= OTA_STALL_TIMEOUT)
+      {
+        otaClient->stop();
+        otaStreaming = false;
+        otaChunkLength = 0;
+        otaLastAttempt = millis();
+      }
+      return;
+    }
+
+    size_t space = min((uint32_t)(OTA_CHUNK_SIZE - otaChunkLength), otaRecord.size - otaRecord.written - otaChunkLength);
+    int length = otaClient->read(otaChunk + otaChunkLength, min((size_t)available, space));
+    if (length <= 0)
+    {
+      return;
+    }
+    otaChunkLength += length;
+    otaSessionBytes += length;
+    otaLastData = millis();
+
+    if (otaChunkLength == OTA_CHUNK_SIZE || otaRecord.written + otaChunkLength == otaRecord.size)
+    {
+      writeOtaChunk();
+    }
+  }
+}
+
+//-----------------------
+
+bool connectOta()
+{
+  if (otaUrl[0] == '\0')
+  {
+    String fileUrl;
+    long fileSize;
+    if (!GrowBot.getFile(fileUrl, fileSize, otaRecord.location))
+    {
+      return false;
+    }
+    strlcpy(otaUrl, fileUrl.c_str(), OTA_URL_SIZE);
+  }
+
+  // http[s]://host[:port]/path
+  bool secure = strncmp(otaUrl, "https://", 8) == 0;
+  const char *host = otaUrl + (secure ? 8 : 7);
+  const char *path = strchr(host, '/');
+  size_t hostLength = path != nullptr ? path - host : strlen(host);
+  char hostName[64];
+  if (hostLength >= sizeof(hostName))
+  {
+    return false;
+  }
+  memcpy(hostName, host, hostLength);
+  hostName[hostLength] = '\0';
+  uint16_t port = secure ? 443 : 80;
+  char *portText = strchr(hostName, ':');
+  if (portText != nullptr)
+  {
+    *portText = '\0';
+    port = atoi(portText + 1);
+  }
+
+  otaClient = secure ? &otaSecureClient : &otaPlainClient;
+  if (!otaClient->connect(hostName, port))
+  {
+    return false;
+  }
+
+  // HTTP/1.0 para receber o corpo sem chunked encoding, pedindo só o que falta da imagem
+  char request[OTA_URL_SIZE + 128];
+  snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nHost: %s\r\nRange: bytes=%u-\r\nConnection: close\r\n\r\n", path != nullptr ? path : "/",
+           hostName, (unsigned int)otaRecord.written);
+  otaClient->print(request);
+
+  char line[128] = {0};
+  otaClient->readBytesUntil('\n', line, sizeof(line) - 1);
+  bool partial = strstr(line, " 206 ") != nullptr;
+  if (!partial && strstr(line, " 200 ") == nullptr)
+  {
+    return false;
+  }
+
+  // Tamanho da imagem: Content-Length da resposta completa ou o total do Content-Range da parcial
+  long contentLength = -1;
+  long totalSize = -1;
+  while (true)
+  {
+    size_t length = otaClient->readBytesUntil('\n', line, sizeof(line) - 1);
+    line[length] = '\0';
+    if (length <= 1)
+    {
+      break;
+    }
+    if (strncasecmp(line, "Content-Length:", 15) == 0)
+    {
+      contentLength = strtol(line + 15, nullptr, 10);
+    }
+    else if (strncasecmp(line, "Content-Range:", 14) == 0 && strchr(line, '/') != nullptr)
+    {
+      totalSize = strtol(strchr(line, '/') + 1, nullptr, 10);
+    }
+  }
+  long size = partial ? totalSize : contentLength;
+  if (size <= 0)
+  {
+    return false;
+  }
+
+  // Servidor sem suporte a Range: a imagem recomeça do zero
+  if (!partial && otaRecord.written > 0)
+  {
+    otaRecord.written = 0;
+    otaHashed = 0;
+    otaLastSave = 0;
+    otaReportedQuarter = 0;
+    mbedtls_sha256_starts_ret(&otaHash, 0);
+  }
+
+  if (otaRecord.size == 0)
+  {
+    if ((uint32_t)size > otaPartition->size)
+    {
+      sendCatalogMessage(MY_ID, MSG_OTA_TOO_LARGE, (unsigned int)size, (unsigned int)otaPartition->size);
+      abortOta();
+      return false;
+    }
+    otaRecord.size = size;
+    saveOtaRecord();
+  }
+  else if ((uint32_t)size != otaRecord.size)
+  {
+    sendCatalogMessage(MY_ID, MSG_OTA_SOURCE_CHANGED);
+    abortOta();
+    return false;
+  }
+
+  if (otaSessionConnects == 0)
+  {
+    if (otaRecord.written > 0)
+    {
+      sendCatalogMessage(MY_ID, MSG_OTA_RESUMED, (unsigned int)otaRecord.written, (unsigned int)otaRecord.size);
+    }
+    otaSessionStart = millis();
+  }
+  otaSessionConnects++;
+  otaStreaming = true;
+  otaLastData = millis();
+  return true;
+}
+
+//-----------------------
+
+void writeOtaChunk()
+{
+  // Every ESP32 application image starts with the same magic byte: rejects a wrong file early
+  if (otaRecord.written == 0 && otaChunk[0] != ESP_IMAGE_HEADER_MAGIC)
+  {
+    sendCatalogMessage(MY_ID, MSG_OTA_NOT_FIRMWARE);
+    abortOta();
+    return;
+  }
+
+  // Chunks are sector sized and aligned: each sector is erased right before it is written, never the whole partition
+  if (esp_partition_erase_range(otaPartition, otaRecord.written, OTA_CHUNK_SIZE) != ESP_OK ||
+      esp_partition_write(otaPartition, otaRecord.written, otaChunk, otaChunkLength) != ESP_OK)
+  {
+    sendCatalogMessage(MY_ID, MSG_OTA_FLASH_FAILED);
+    abortOta();
+    return;
+  }
+
+  mbedtls_sha256_update_ret(&otaHash, otaChunk, otaChunkLength);
+  otaRecord.written += otaChunkLength;
+  otaHashed = otaRecord.written;
+  otaChunkLength = 0;
+
+  if (otaRecord.written == otaRecord.size)
+  {
+    finishOta();
+    return;
+  }
+
+  if (otaRecord.written - otaLastSave >= OTA_SAVE_INTERVAL)
+  {
+    saveOtaRecord();
+    otaLastSave = otaRecord.written;
+  }
+
+  int quarter = (uint64_t)otaRecord.written * 4 / otaRecord.size;
+  if (quarter > otaReportedQuarter)
+  {
+    otaReportedQuarter = quarter;
+    sendOtaProgress(MY_ID);
+  }
+}
+
+//-----------------------
+
+void finishOta()
+{
+  uint8_t digest[32];
+  mbedtls_sha256_finish_ret(&otaHash, digest);
+  uint32_t throughput = getOtaThroughput();
+
+  if (memcmp(digest, otaRecord.sha256, sizeof(digest)) != 0)
+  {
+    sendCatalogMessage(MY_ID, MSG_OTA_HASH_MISMATCH);
+    abortOta();
+    return;
+  }
+  // Also validates the image structure and its own checksum before switching the boot partition
+  if (esp_ota_set_boot_partition(otaPartition) != ESP_OK)
+  {
+    sendCatalogMessage(MY_ID, MSG_OTA_INVALID_IMAGE);
+    abortOta();
+    return;
+  }
+
+  endOtaSession();
+  otaRecord.phase = OTA_INSTALLED;
+  otaRecord.previous = esp_ota_get_running_partition()->address;
+  otaRecord.bootAttempts = 0;
+  saveOtaRecord();
+  sendCatalogMessage(MY_ID, MSG_OTA_INSTALLED, (unsigned int)otaRecord.size, (unsigned int)throughput);
+  ESP.restart();
+}
+
+//-----------------------
+
+void abortOta()
+{
+  endOtaSession();
+  otaRecord.magic = 0;
+  otaRecord.phase = OTA_IDLE;
+  saveOtaRecord();
+}
+
+//-----------------------
+
+void beginOtaSession()
+{
+  // The hash starts over: after a reboot continueOta feeds it the bytes already in the partition
+  mbedtls_sha256_init(&otaHash);
+  mbedtls_sha256_starts_ret(&otaHash, 0);
+  otaHashed = 0;
+  otaChunkLength = 0;
+  otaStreaming = false;
+  otaLastAttempt = 0;
+  otaSessionBytes = 0;
+  otaSessionStart = millis();
+  otaSessionConnects = 0;
+  otaReportedQuarter = otaRecord.size > 0 ? (uint64_t)otaRecord.written * 4 / otaRecord.size : 0;
+  otaLastSave = otaRecord.written;
+
+  otaUrl[0] = '\0';
+  if (otaRecord.source == OTA_SOURCE_URL)
+  {
+    strlcpy(otaUrl, otaRecord.location, OTA_URL_SIZE);
+  }
+
+  // The radio stays awake while the image streams (no modem or light sleep)
+  WiFi.setSleep(false);
+  if (otaPmLock != nullptr)
+  {
+    esp_pm_lock_acquire(otaPmLock);
+  }
+}
+
+//-----------------------
+
+void endOtaSession()
+{
+  otaClient->stop();
+  otaStreaming = false;
+  mbedtls_sha256_free(&otaHash);
+
+  WiFi.setSleep(true);
+  if (otaPmLock != nullptr)
+  {
+    esp_pm_lock_release(otaPmLock);
+  }
+}
+
+//-----------------------
+
+void saveOtaRecord()
+{
+  EEPROM.put(otaAddress, otaRecord);
+  EEPROM.commit();
+}
+
+//-----------------------
+
+void sendOtaProgress(const char *chatId)
+{
+  unsigned int percent = otaRecord.size > 0 ? (uint64_t)otaRecord.written * 100 / otaRecord.size : 0;
+  sendCatalogMessage(chatId, MSG_OTA_PROGRESS, percent, (unsigned int)otaRecord.written, (unsigned int)otaRecord.size, (unsigned int)getOtaThroughput());
+}
+
+//-----------------------
+
+uint32_t getOtaThroughput()
+{
+  unsigned long elapsed = millis() - otaSessionStart;
+  if (otaSessionConnects == 0 || elapsed == 0)
+  {
+    return 0;
+  }
+  // Wall clock rate: includes the time given to the other stages between the slices
+  return (uint64_t)otaSessionBytes * 1000 / elapsed;
+}
+
+//-----------------------
+
+void checkOtaBoot()
+{
+  if (otaPendingVerify)
+  {
+    // Um firmware novo é válido quando fala com o bot - até lá um reset (travamento, watchdog) faz o bootloader voltar ao anterior
+    if (sentFirstMessage)
+    {
+      if (otaBootloaderRollback)
+      {
+        esp_ota_mark_app_valid_cancel_rollback();
+      }
+      otaRecord.previous = 0;
+      saveOtaRecord();
+      otaPendingVerify = false;
+    }
+    else if (millis() >= OTA_VERIFY_TIMEOUT)
+    {
+      if (otaBootloaderRollback)
+      {
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+      }
+      else if (!rollBackOta())
+      {
+        // Nada para onde voltar: fica com o firmware novo
+        otaRecord.previous = 0;
+        saveOtaRecord();
+        otaPendingVerify = false;
+      }
+    }
+    return;
+  }
+
+  if (!otaReportPending || !sentFirstMessage || WiFi.status() != WL_CONNECTED)
+  {
+    return;
+  }
+  sendCatalogMessage(MY_ID, otaReportMessage);
+  otaReportPending = false;
+  if (otaRecord.phase == OTA_INSTALLED)
+  {
+    otaRecord.magic = 0;
+    otaRecord.phase = OTA_IDLE;
+    saveOtaRecord();
+  }
+}
+
+//-----------------------
+
+bool rollBackOta()
+{
+  const esp_partition_t *previous = findAppPartition(otaRecord.previous);
+  if (previous == nullptr || esp_ota_set_boot_partition(previous) != ESP_OK)
+  {
+    return false;
+  }
+  // The record stays OTA_INSTALLED: the old firmware finds itself running and reports the rollback
+  otaRecord.previous = 0;
+  saveOtaRecord();
+  ESP.restart();
+  return true;
+}
+
+//-----------------------
+
+const esp_partition_t *findAppPartition(uint32_t address)
+{
+  if (address == 0)
+  {
+    return nullptr;
+  }
+  for (esp_partition_iterator_t iterator = esp_partition_find(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, nullptr); iterator != nullptr;
+       iterator = esp_partition_next(iterator))
+  {
+    const esp_partition_t *partition = esp_partition_get(iterator);
+    if (partition->address == address)
+    {
+      esp_partition_iterator_release(iterator);
+      return partition;
+    }
+  }
+  return nullptr;
+}
+
+//-----------------------
+
+bool parseSha256(const char *hex, uint8_t *digest)
+{
+  if (strlen(hex) != 64)
+  {
+    return false;
+  }
+  for (int i = 0; i < 32; i++)
+  {
+    if (!isxdigit(hex[2 * i]) || !isxdigit(hex[2 * i + 1]))
+    {
+      return false;
+    }
+    char byteText[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+    digest[i] = strtoul(byteText, nullptr, 16);
+  }
+  return true;
+}
+
+//-----------------------
+
+bool verifyRollbackLater()
+{
+  return true;
+}
@@ -0,0 +1,177 @@
+// Host tests of the idle deadline (pio test -e native)
+
+#include <unity.h>
+#include <Deadlines.h>
+#include <LoopJobs.h>
+
+// Simulated millis() starts 2 hours before the wraparound
+#define START_TIME (0xFFFFFFFFUL - 2 * ONE_HOUR)
+// Simulated time: three days across the wraparound
+#define SIMULATED_TIME (3ULL * 24 * ONE_HOUR)
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+//-----------------------
+
+void test_no_active_job_waits_the_maximum(void)
+{
+  Deadline deadlines[] = {
+      {false, 0, 1000},
+      {false, 5000, 0},
+  };
+  TEST_ASSERT_EQUAL_UINT32(MAX_IDLE_TIME, findNextDeadline(10000, deadlines, 2, MAX_IDLE_TIME));
+  TEST_ASSERT_EQUAL_UINT32(MAX_IDLE_TIME, findNextDeadline(10000, deadlines, 0, MAX_IDLE_TIME));
+}
+
+//-----------------------
+
+void test_earliest_job_wins(void)
+{
+  Deadline deadlines[] = {
+      {true, 0, ONE_HOUR},
+      {true, 9000, BOT_POLL_INTERVAL},
+      {true, 5000, HISTORY_PERIOD},
+  };
+  TEST_ASSERT_EQUAL_UINT32(2000, findNextDeadline(10000, deadlines, 3, MAX_IDLE_TIME));
+}
+
+//-----------------------
+
+void test_due_job_returns_zero(void)
+{
+  Deadline deadlines[] = {
+      {true, 0, ONE_HOUR},
+      {true, 7000, BOT_POLL_INTERVAL},
+  };
+  TEST_ASSERT_EQUAL_UINT32(0, findNextDeadline(10000, deadlines, 2, MAX_IDLE_TIME));
+  // Interval 0: due right away (firmware download streaming)
+  deadlines[1] = {true, 10000, 0};
+  TEST_ASSERT_EQUAL_UINT32(0, findNextDeadline(10000, deadlines, 2, MAX_IDLE_TIME));
+}
+
+//-----------------------
+
+void test_wait_is_capped(void)
+{
+  Deadline deadlines[] = {
+      {true, 0, ONE_HOUR},
+  };
+  TEST_ASSERT_EQUAL_UINT32(MAX_IDLE_TIME, findNextDeadline(1000, deadlines, 1, MAX_IDLE_TIME));
+}
+
+//-----------------------
+
+void test_millis_wraparound(void)
+{
+  // Started 0x100 ms before the wrap, now 0x10 ms after it: 0x110 ms elapsed
+  Deadline deadlines[] = {
+      {true, 0xFFFFFF00UL, 1000},
+  };
+  TEST_ASSERT_EQUAL_UINT32(1000 - 0x110, findNextDeadline(0x10, deadlines, 1, MAX_IDLE_TIME));
+
+  deadlines[0].interval = 0x100;
+  TEST_ASSERT_EQUAL_UINT32(0, findNextDeadline(0x10, deadlines, 1, MAX_IDLE_TIME));
+}
+
+//-----------------------
+
+// Loop job of the simulation: fixed delay jobs restart when they run, fixed rate ones keep their phase
+struct SimulatedJob
+{
+  Deadline deadline;
+  bool fixedRate;
+  unsigned long runs;
+};
+
+// Pseudo-random active time of one loop pass, in milliseconds
+uint32_t nextWorkTime(uint32_t &seed)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) % 250;
+}
+
+void test_simulated_loop_never_oversleeps(void)
+{
+  uint32_t now = START_TIME;
+  SimulatedJob jobs[] = {
+      {{true, now, BOT_POLL_INTERVAL}, false, 0},
+      {{true, now, ONE_HOUR}, false, 0},
+      {{true, now, HISTORY_PERIOD}, false, 0},
+      {{true, now - 12345, RULE_CLOCK_PERIOD}, true, 0},
+      {{true, now, OTA_RETRY_INTERVAL}, false, 0},
+  };
+  const int jobCount = sizeof(jobs) / sizeof(jobs[0]);
+  Deadline deadlines[jobCount];
+
+  uint32_t seed = 1;
+  uint64_t elapsed = 0;
+  while (elapsed < SIMULATED_TIME)
+  {
+    // Active part of the loop: runs the due jobs
+    for (int i = 0; i < jobCount; i++)
+    {
+      Deadline &deadline = jobs[i].deadline;
+      if ((uint32_t)(now - deadline.start) >= deadline.interval)
+      {
+        deadline.start = jobs[i].fixedRate ? deadline.start + deadline.interval : now;
+        jobs[i].runs++;
+      }
+    }
+    uint32_t work = nextWorkTime(seed);
+    now += work;
+    elapsed += work;
+
+    // Idle part: sleeps until the next deadline
+    for (int i = 0; i < jobCount; i++)
+    {
+      deadlines[i] = jobs[i].deadline;
+    }
+    uint32_t wait = findNextDeadline(now, deadlines, jobCount, MAX_IDLE_TIME);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(MAX_IDLE_TIME, wait);
+    now += wait;
+    elapsed += wait;
+
+    bool due = false;
+    for (int i = 0; i < jobCount; i++)
+    {
+      uint32_t sinceStart = now - jobs[i].deadline.start;
+      // After a real sleep no job is late: the wait ended at the earliest deadline
+      if (wait > 0)
+      {
+        TEST_ASSERT_LESS_OR_EQUAL_UINT32(jobs[i].deadline.interval, sinceStart);
+      }
+      due = due || sinceStart >= jobs[i].deadline.interval;
+    }
+    // No busy loop: a pass that did not sleep has a due job
+    if (wait == 0)
+    {
+      TEST_ASSERT_TRUE(due);
+    }
+  }
+
+  TEST_ASSERT_TRUE(now < START_TIME);
+  // Fixed delay jobs drift by the active time of the pass that runs them
+  TEST_ASSERT_GREATER_OR_EQUAL(SIMULATED_TIME / ONE_HOUR - 1, jobs[1].runs);
+  TEST_ASSERT_GREATER_OR_EQUAL(SIMULATED_TIME / HISTORY_PERIOD - 1, jobs[2].runs);
+  TEST_ASSERT_GREATER_OR_EQUAL(SIMULATED_TIME / RULE_CLOCK_PERIOD, jobs[3].runs);
+}
+
+//-----------------------
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_no_active_job_waits_the_maximum);
+  RUN_TEST(test_earliest_job_wins);
+  RUN_TEST(test_due_job_returns_zero);
+  RUN_TEST(test_wait_is_capped);
+  RUN_TEST(test_millis_wraparound);
+  RUN_TEST(test_simulated_loop_never_oversleeps);
+  return UNITY_END();
+}
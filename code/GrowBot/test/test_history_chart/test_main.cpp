@@ -0,0 +1,326 @@
+// Host tests of the streaming chart PNG: the image decodes with independent checks, and the encoder benchmark (pio test -e native)
+
+#include <unity.h>
+#include <HistoryChart.h>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+// Seven days of 15 minute samples, as in the firmware
+#define SAMPLES_PER_HOUR 4
+#define HISTORY_SAMPLES (168 * SAMPLES_PER_HOUR)
+
+// Largest PNG the test encodes
+#define MAX_PNG_SIZE 32768
+
+HistorySample history[HISTORY_SAMPLES];
+int historyCount;
+
+ChartEncoder encoder;
+uint8_t png[MAX_PNG_SIZE];
+
+// Decoded image: palette index of each pixel
+uint8_t pixels[CHART_HEIGHT][CHART_WIDTH];
+
+bool getTestSample(int periodsBack, HistorySample &sample)
+{
+  if (periodsBack < 0 || periodsBack >= historyCount)
+  {
+    return false;
+  }
+  sample = history[periodsBack];
+  return true;
+}
+
+// Synthetic history: light 18/6 with the FS on in the middle, fan every other hour, pump once a day, sensors as waves
+void fillHistory(int count)
+{
+  historyCount = count;
+  for (int i = 0; i < count; i++)
+  {
+    int hour = (i / SAMPLES_PER_HOUR) % 24;
+    HistorySample &sample = history[i];
+    sample.flags = HISTORY_TEMPERATURE | HISTORY_SOIL;
+    if (hour < 18)
+    {
+      sample.flags |= HISTORY_LED | (hour >= 6 && hour < 12 ? HISTORY_FS : 0);
+    }
+    if (hour % 2 == 0)
+    {
+      sample.flags |= HISTORY_VENTILATION;
+    }
+    if (i % (24 * SAMPLES_PER_HOUR) == 3)
+    {
+      sample.flags |= HISTORY_PUMP;
+    }
+    sample.temperature = 20 + (i % 40) / 4;
+    sample.soil = 30 + (i * 7) % 60;
+  }
+}
+
+// Encode the whole chart with the upload loop of the firmware. Returns the PNG size.
+int encodeChart(int hours)
+{
+  beginChart(encoder, getTestSample, hours, SAMPLES_PER_HOUR);
+  int size = 0;
+  while (encoder.part != PART_DONE)
+  {
+    encodeNextChartPart(encoder);
+    TEST_ASSERT_LESS_OR_EQUAL(MAX_PNG_SIZE, size + encoder.length);
+    memcpy(png + size, encoder.buffer, encoder.length);
+    size += encoder.length;
+  }
+  return size;
+}
+
+uint32_t readUint32(const uint8_t *data)
+{
+  return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+// Bitwise CRC-32, independent from the table of the encoder
+uint32_t referenceCrc(const uint8_t *data, int length)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  for (int i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+// Decode the PNG into pixels[], checking every chunk, the zlib stream and the scanlines
+void decodeChart(int size)
+{
+  const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  TEST_ASSERT_EQUAL_MEMORY(signature, png, sizeof(signature));
+
+  int offset = 8;
+  bool sawHeader = false;
+  bool sawPalette = false;
+  bool sawEnd = false;
+  const uint8_t *imageData = nullptr;
+  uint32_t imageLength = 0;
+  while (offset < size)
+  {
+    TEST_ASSERT_LESS_OR_EQUAL(size, offset + 12);
+    uint32_t length = readUint32(png + offset);
+    const uint8_t *type = png + offset + 4;
+    const uint8_t *data = png + offset + 8;
+    TEST_ASSERT_LESS_OR_EQUAL(size, offset + 12 + (int)length);
+    TEST_ASSERT_EQUAL_HEX32(referenceCrc(type, length + 4), readUint32(data + length));
+
+    if (memcmp(type, "IHDR", 4) == 0)
+    {
+      TEST_ASSERT_EQUAL_UINT32(13, length);
+      TEST_ASSERT_EQUAL_UINT32(CHART_WIDTH, readUint32(data));
+      TEST_ASSERT_EQUAL_UINT32(CHART_HEIGHT, readUint32(data + 4));
+      // 4 bits per pixel, palette, deflate, no filter method, no interlace
+      const uint8_t format[5] = {4, 3, 0, 0, 0};
+      TEST_ASSERT_EQUAL_MEMORY(format, data + 8, sizeof(format));
+      sawHeader = true;
+    }
+    else if (memcmp(type, "PLTE", 4) == 0)
+    {
+      TEST_ASSERT_EQUAL_UINT32(COLOR_COUNT * 3, length);
+      sawPalette = true;
+    }
+    else if (memcmp(type, "IDAT", 4) == 0)
+    {
+      imageData = data;
+      imageLength = length;
+    }
+    else if (memcmp(type, "IEND", 4) == 0)
+    {
+      TEST_ASSERT_EQUAL_UINT32(0, length);
+      sawEnd = true;
+    }
+    offset += 12 + length;
+  }
+  TEST_ASSERT_EQUAL(size, offset);
+  TEST_ASSERT_TRUE(sawHeader && sawPalette && sawEnd);
+  TEST_ASSERT_NOT_NULL(imageData);
+
+  // zlib: valid header check bits, stored final blocks, adler32 of the scanlines
+  TEST_ASSERT_EQUAL(0, ((imageData[0] << 8) | imageData[1]) % 31);
+  TEST_ASSERT_EQUAL_HEX32(8, imageData[0] & 0x0F);
+  static uint8_t raw[CHART_RAW_SIZE];
+  uint32_t rawLength = 0;
+  uint32_t position = 2;
+  bool final = false;
+  while (!final)
+  {
+    final = imageData[position] & 1;
+    TEST_ASSERT_EQUAL(0, (imageData[position] >> 1) & 3);
+    uint16_t blockLength = imageData[position + 1] | (imageData[position + 2] << 8);
+    uint16_t complement = imageData[position + 3] | (imageData[position + 4] << 8);
+    TEST_ASSERT_EQUAL(0xFFFF, blockLength ^ complement);
+    TEST_ASSERT_LESS_OR_EQUAL(CHART_RAW_SIZE, rawLength + blockLength);
+    memcpy(raw + rawLength, imageData + position + 5, blockLength);
+    rawLength += blockLength;
+    position += 5 + blockLength;
+  }
+  TEST_ASSERT_EQUAL_UINT32(CHART_RAW_SIZE, rawLength);
+  TEST_ASSERT_EQUAL_UINT32(imageLength, position + 4);
+
+  uint32_t a = 1;
+  uint32_t b = 0;
+  for (uint32_t i = 0; i < rawLength; i++)
+  {
+    a = (a + raw[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  TEST_ASSERT_EQUAL_HEX32((b << 16) | a, readUint32(imageData + position));
+
+  // Scanlines: filter 0, two palette indexes per byte
+  for (int row = 0; row < CHART_HEIGHT; row++)
+  {
+    const uint8_t *line = raw + row * CHART_ROW_BYTES;
+    TEST_ASSERT_EQUAL(0, line[0]);
+    for (int x = 0; x < CHART_WIDTH; x++)
+    {
+      uint8_t value = line[1 + x / 2];
+      pixels[row][x] = x % 2 == 0 ? value >> 4 : value & 0x0F;
+      TEST_ASSERT_LESS_THAN(COLOR_COUNT, pixels[row][x]);
+    }
+  }
+}
+
+void setUp(void)
+{
+  fillHistory(HISTORY_SAMPLES);
+}
+
+void tearDown(void)
+{
+}
+
+//-----------------------
+
+void test_chart_decodes(void)
+{
+  int size = encodeChart(24);
+  TEST_ASSERT_EQUAL(getChartFileSize(), size);
+  decodeChart(size);
+}
+
+//-----------------------
+
+void test_decoded_lanes_follow_the_history(void)
+{
+  decodeChart(encodeChart(24));
+
+  int middle = CHART_LANE_HEIGHT / 2;
+  for (int x = 0; x < CHART_WIDTH; x++)
+  {
+    HistorySample sample;
+    TEST_ASSERT_TRUE(getChartSample(encoder, x, sample));
+    uint8_t light = pixels[CHART_LIGHT_TOP + middle][x];
+    uint8_t ventilation = pixels[CHART_VENTILATION_TOP + middle][x];
+    if (sample.flags & HISTORY_LED)
+    {
+      TEST_ASSERT_EQUAL(sample.flags & HISTORY_FS ? COLOR_FS : COLOR_LED, light);
+    }
+    else
+    {
+      TEST_ASSERT_TRUE(light == COLOR_LANE || light == COLOR_GRID);
+    }
+    if (sample.flags & HISTORY_VENTILATION)
+    {
+      TEST_ASSERT_EQUAL(COLOR_VENTILATION, ventilation);
+    }
+    // Both sensor lines pass through the row of their value (temperature is drawn over soil where they cross)
+    TEST_ASSERT_EQUAL(COLOR_TEMPERATURE, pixels[getSensorRow(sample, HISTORY_TEMPERATURE)][x]);
+    uint8_t soil = pixels[getSensorRow(sample, HISTORY_SOIL)][x];
+    TEST_ASSERT_TRUE(soil == COLOR_SOIL || soil == COLOR_TEMPERATURE);
+  }
+}
+
+//-----------------------
+
+void test_short_history_leaves_empty_columns(void)
+{
+  // Two hours of samples in a 24 hour chart: only the right end has data
+  fillHistory(2 * SAMPLES_PER_HOUR);
+  decodeChart(encodeChart(24));
+  TEST_ASSERT_TRUE(pixels[CHART_LIGHT_TOP][0] == COLOR_LANE || pixels[CHART_LIGHT_TOP][0] == COLOR_GRID);
+  TEST_ASSERT_EQUAL(COLOR_LED, pixels[CHART_LIGHT_TOP][CHART_WIDTH - 1]);
+  for (int row = CHART_SENSOR_TOP; row < CHART_SENSOR_TOP + CHART_SENSOR_HEIGHT; row++)
+  {
+    TEST_ASSERT_TRUE(pixels[row][0] == COLOR_BACKGROUND || pixels[row][0] == COLOR_GRID);
+  }
+}
+
+//-----------------------
+
+void test_every_range_decodes(void)
+{
+  const int ranges[] = {1, 6, 24, 72, 168};
+  for (int hours : ranges)
+  {
+    int size = encodeChart(hours);
+    TEST_ASSERT_EQUAL(getChartFileSize(), size);
+    decodeChart(size);
+  }
+}
+
+//-----------------------
+
+void test_crc_matches_the_reference(void)
+{
+  const char *text = "123456789";
+  TEST_ASSERT_EQUAL_HEX32(0xCBF43926, updateCrc(0, (const uint8_t *)text, 9));
+  // Incremental updates, as the encoder does row by row
+  uint32_t crc = updateCrc(0, (const uint8_t *)text, 4);
+  TEST_ASSERT_EQUAL_HEX32(0xCBF43926, updateCrc(crc, (const uint8_t *)text + 4, 5));
+}
+
+//-----------------------
+
+void test_encoder_benchmark(void)
+{
+  // Host time of a full 7 day chart, and how much of it each part takes (the ESP32 takes several times longer)
+  const int runs = 20;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < runs; i++)
+  {
+    encodeChart(168);
+  }
+  auto total = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+  uint8_t row[CHART_ROW_BYTES];
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < runs; i++)
+  {
+    for (int y = 0; y < CHART_HEIGHT; y++)
+    {
+      renderChartRow(encoder, y, row);
+    }
+  }
+  auto rows = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+  char report[160];
+  snprintf(report, sizeof(report), "168 h chart: %ld us per PNG (%ld us rendering rows), %d bytes, encoder state %u bytes",
+           (long)(total / runs), (long)(rows / runs), getChartFileSize(), (unsigned)sizeof(ChartEncoder));
+  TEST_MESSAGE(report);
+  // The upload must not be held back by the encoder: well under a second per chart
+  TEST_ASSERT_LESS_THAN(1000000L, (long)(total / runs));
+}
+
+//-----------------------
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_chart_decodes);
+  RUN_TEST(test_decoded_lanes_follow_the_history);
+  RUN_TEST(test_short_history_leaves_empty_columns);
+  RUN_TEST(test_every_range_decodes);
+  RUN_TEST(test_crc_matches_the_reference);
+  RUN_TEST(test_encoder_benchmark);
+  return UNITY_END();
+}
@@ -0,0 +1,327 @@
+// Host tests of the message catalog and its RAM footprint against the String replies it replaced (pio test -e native)
+
+#include <unity.h>
+#include <MessageCatalog.h>
+#include <stdio.h>
+#include <string.h>
+
+// Same size as the firmware reply buffer
+#define MESSAGE_BUFFER_SIZE 1024
+
+// ESP32 Arduino core 2.x String: 12 byte object, up to 9 characters inline (SSO),
+// heap buffers rounded to 16 bytes and regrown on every concat that does not fit
+#define STRING_OBJECT_SIZE 12
+#define STRING_SSO_LENGTH 9
+#define STRING_HEAP_SIZE(length) (((length) + 16) & ~15)
+
+// Command tokens of the String build (struct of String members) - now const char pointers to flash
+const char *const commandTokens[] = {"/status", "/luz", "/ligaluz", "/desligaLuz", "/ciclo", "/ger", "/veg", "/flor",
+                                     "/irrigacao", "/irrigar", "/irrigado", "/ligaautoirrigacao", "/desligaautoirrigacao",
+                                     "/intervaloirrigacao", "/tempoirrigacao", "/ventilacao", "/ligaventilacao",
+                                     "/desligaventilacao"};
+#define COMMAND_TOKEN_COUNT (sizeof(commandTokens) / sizeof(commandTokens[0]))
+
+char messageBuffer[MESSAGE_BUFFER_SIZE];
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+//-----------------------
+
+// Heap bytes and allocations of the modeled Strings
+struct HeapModel
+{
+  size_t live;
+  size_t peak;
+  unsigned long allocations;
+};
+
+HeapModel heapModel;
+
+void modelAllocate(size_t oldSize, size_t newSize)
+{
+  heapModel.live += newSize - oldSize;
+  if (heapModel.live > heapModel.peak)
+  {
+    heapModel.peak = heapModel.live;
+  }
+  heapModel.allocations++;
+}
+
+// Length-only model of the Arduino String: tracks the heap it would use, not the text
+class ModelString
+{
+public:
+  ModelString(const char *text) : length(0), heapSize(0)
+  {
+    concat(strlen(text));
+  }
+
+  ModelString(long value) : length(0), heapSize(0)
+  {
+    char digits[16];
+    concat(snprintf(digits, sizeof(digits), "%ld", value));
+  }
+
+  ModelString(const ModelString &other) : length(0), heapSize(0)
+  {
+    concat(other.length);
+  }
+
+  ~ModelString()
+  {
+    heapModel.live -= heapSize;
+  }
+
+  ModelString &operator+=(const ModelString &other)
+  {
+    concat(other.length);
+    return *this;
+  }
+
+  ModelString &operator+=(const char *text)
+  {
+    concat(strlen(text));
+    return *this;
+  }
+
+  // "literal" + String(x) + ...: a temporary copy of the left side that grows with each operand
+  friend ModelString operator+(ModelString left, const ModelString &right)
+  {
+    left.concat(right.length);
+    return left;
+  }
+
+  friend ModelString operator+(ModelString left, const char *right)
+  {
+    left.concat(strlen(right));
+    return left;
+  }
+
+  size_t length;
+  size_t heapSize;
+
+private:
+  void concat(size_t extra)
+  {
+    size_t newLength = length + extra;
+    if (newLength > STRING_SSO_LENGTH && (heapSize == 0 || newLength > heapSize - 1))
+    {
+      size_t newSize = STRING_HEAP_SIZE(newLength);
+      modelAllocate(heapSize, newSize);
+      heapSize = newSize;
+    }
+    length = newLength;
+  }
+};
+
+//-----------------------
+
+// sendStatusInfo of the String build, as it was
+size_t buildStringStatus()
+{
+  // chatId was passed by value
+  ModelString chatId("123456789012");
+  ModelString message = "Status:\n\n";
+
+  message += "LUZ \xF0\x9F\x92\xA1 \n";
+  message += ModelString("- Ciclo de luz: ") + (ModelString("Vegetativo") + ModelString(" (18/6)")) + ".\n";
+  message += ModelString("- Status da luz: ") + ModelString("ligada") + ".\n";
+  message += ModelString("- Etapa de iluminação: ") + ModelString(2L) + ".\n";
+  message += ModelString("- Tempo dês de a ultima mudança na luz: ") + ModelString(13L) + " horas.\n";
+  message += "\n";
+
+  message += "IRRIGAÇÃO \xF0\x9F\x9A\xBF \n";
+  message += ModelString("- Intervalo entre irrigações: ") + ModelString(5L) + " dias.\n";
+  message += ModelString("- Tempo de irrigação: ") + ModelString(15L) + " segundos.\n";
+  message += ModelString("- Status da auto-irrigação: ") + ModelString("desligada") + ".\n";
+  message += ModelString("- Tempo dês de a ultima irrigação: ") + ModelString(3L) + " dias e " + ModelString(7L) + " horas.\n";
+  message += "\n";
+
+  message += "VENTILAÇÃO \xF0\x9F\x86\x92 \n";
+  message += ModelString("- Status da ventilação: ") + ModelString("ligada") + ".\n";
+  return message.length;
+}
+
+//-----------------------
+
+// Render a catalog message into the reply buffer
+size_t render(size_t offset, Locale locale, MessageId id, ...)
+{
+  va_list args;
+  va_start(args, id);
+  size_t length = renderCatalogText(messageBuffer, MESSAGE_BUFFER_SIZE, offset, locale, id, args);
+  va_end(args);
+  return length;
+}
+
+// Render an english catalog message into a given buffer
+size_t renderInto(char *buffer, size_t size, size_t offset, MessageId id, ...)
+{
+  va_list args;
+  va_start(args, id);
+  size_t length = renderCatalogText(buffer, size, offset, LOCALE_EN, id, args);
+  va_end(args);
+  return length;
+}
+
+// sendStatusInfo sections that existed in the String build
+size_t buildCatalogStatus()
+{
+  size_t length = render(0, LOCALE_PT_BR, MSG_STATUS_LIGHT, "Vegetativo", 18, 6, "ligada", 2, 13u);
+  length = render(length, LOCALE_PT_BR, MSG_STATUS_IRRIGATION, 5, 15, "desligada", 3u, 7u);
+  return render(length, LOCALE_PT_BR, MSG_STATUS_VENTILATION, "ligada");
+}
+
+//-----------------------
+
+// Next printf conversion of a template ("d", "ld", "u", "s", ".1f"...), nullptr at the end
+const char *nextConversion(const char *text, char *conversion, size_t size)
+{
+  while ((text = strchr(text, '%')) != nullptr)
+  {
+    text++;
+    if (*text == '%')
+    {
+      text++;
+      continue;
+    }
+    size_t length = strspn(text, "0123456789.-+ #lhz");
+    length += text[length] != '\0';
+    snprintf(conversion, size, "%.*s", (int)length, text);
+    return text + length;
+  }
+  return nullptr;
+}
+
+//-----------------------
+
+void test_every_message_has_text(void)
+{
+  for (int locale = 0; locale < LOCALE_COUNT; locale++)
+  {
+    for (int id = 0; id < MSG_COUNT; id++)
+    {
+      const char *text = getCatalogText((Locale)locale, (MessageId)id);
+      TEST_ASSERT_NOT_NULL(text);
+      TEST_ASSERT_GREATER_THAN(0, strlen(text));
+    }
+  }
+}
+
+//-----------------------
+
+void test_locales_take_the_same_arguments(void)
+{
+  // Every locale renders the same argument list: the conversions must match one by one
+  for (int id = 0; id < MSG_COUNT; id++)
+  {
+    const char *portuguese = getCatalogText(LOCALE_PT_BR, (MessageId)id);
+    for (int locale = 1; locale < LOCALE_COUNT; locale++)
+    {
+      const char *other = getCatalogText((Locale)locale, (MessageId)id);
+      char expected[8];
+      char actual[8];
+      const char *a = portuguese;
+      const char *b = other;
+      do
+      {
+        a = nextConversion(a, expected, sizeof(expected));
+        b = nextConversion(b, actual, sizeof(actual));
+        TEST_ASSERT_EQUAL_MESSAGE(a == nullptr, b == nullptr, other);
+        if (a != nullptr)
+        {
+          TEST_ASSERT_EQUAL_STRING_MESSAGE(expected, actual, other);
+        }
+      } while (a != nullptr);
+    }
+  }
+}
+
+//-----------------------
+
+void test_render_appends_sections(void)
+{
+  size_t length = render(0, LOCALE_EN, MSG_VENTILATION_STATUS, "on");
+  TEST_ASSERT_EQUAL_STRING("Ventilation on.", messageBuffer);
+  length = render(length, LOCALE_EN, MSG_IRRIGATION_DONE);
+  TEST_ASSERT_EQUAL_STRING("Ventilation on.Irrigation done.", messageBuffer);
+  TEST_ASSERT_EQUAL(strlen(messageBuffer), length);
+}
+
+//-----------------------
+
+void test_render_truncates_at_the_buffer_limit(void)
+{
+  char small[16];
+  // Sections past the limit keep the length at the end of the buffer
+  size_t length = 0;
+  for (int i = 0; i < 3; i++)
+  {
+    length = renderInto(small, sizeof(small), length, MSG_IRRIGATION_DONE);
+  }
+  TEST_ASSERT_EQUAL(sizeof(small) - 1, length);
+  TEST_ASSERT_EQUAL_STRING("Irrigation done", small);
+}
+
+//-----------------------
+
+void test_ram_footprint_against_string_replies(void)
+{
+  char report[160];
+
+  // Static RAM: String members (object + heap copy) against pointers to flash, plus the reply buffer
+  size_t stringTokens = 0;
+  for (size_t i = 0; i < COMMAND_TOKEN_COUNT; i++)
+  {
+    size_t length = strlen(commandTokens[i]);
+    stringTokens += STRING_OBJECT_SIZE + (length > STRING_SSO_LENGTH ? STRING_HEAP_SIZE(length) : 0);
+  }
+  size_t catalogTokens = COMMAND_TOKEN_COUNT * 4;
+  snprintf(report, sizeof(report), "command tokens: %u bytes as String, %u bytes as flash pointers (+%u bytes reply buffer)",
+           (unsigned)stringTokens, (unsigned)catalogTokens, (unsigned)MESSAGE_BUFFER_SIZE);
+  TEST_MESSAGE(report);
+  TEST_ASSERT_LESS_THAN(stringTokens, catalogTokens);
+
+  // /status: String concatenation against one render into the reply buffer
+  heapModel = {};
+  size_t stringLength = buildStringStatus();
+  HeapModel stringHeap = heapModel;
+  TEST_ASSERT_EQUAL(0, heapModel.live);
+
+  size_t catalogLength = buildCatalogStatus();
+  TEST_ASSERT_LESS_THAN(MESSAGE_BUFFER_SIZE - 1, catalogLength);
+  // Same text, except the blank line that now separates the energy section
+  TEST_ASSERT_EQUAL(stringLength + 1, catalogLength);
+  // sendMessage takes a String: the rendered reply is copied once
+  heapModel = {};
+  {
+    ModelString copy(messageBuffer);
+  }
+  HeapModel catalogHeap = heapModel;
+
+  snprintf(report, sizeof(report), "/status (%u bytes): String build %lu allocations, heap peak %u bytes; catalog %lu allocation, heap peak %u bytes",
+           (unsigned)stringLength, stringHeap.allocations, (unsigned)stringHeap.peak, catalogHeap.allocations, (unsigned)catalogHeap.peak);
+  TEST_MESSAGE(report);
+  TEST_ASSERT_EQUAL(1, catalogHeap.allocations);
+  TEST_ASSERT_LESS_THAN(stringHeap.peak, catalogHeap.peak);
+  TEST_ASSERT_LESS_THAN(stringHeap.allocations, catalogHeap.allocations);
+}
+
+//-----------------------
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_every_message_has_text);
+  RUN_TEST(test_locales_take_the_same_arguments);
+  RUN_TEST(test_render_appends_sections);
+  RUN_TEST(test_render_truncates_at_the_buffer_limit);
+  RUN_TEST(test_ram_footprint_against_string_replies);
+  return UNITY_END();
+}
@@ -0,0 +1,259 @@
+// Host tests of the automation rules and their evaluation passes (pio test -e native)
+
+#include <unity.h>
+#include <RuleEngine.h>
+#include <string.h>
+
+RuleEngine engine;
+
+// What the simulated firmware did
+struct SimulatedBox
+{
+  bool evaluating;
+  bool irrigating;
+  int irrigations;
+  int notifications[MAX_RULES];
+  int longestPumpSignal;
+};
+
+SimulatedBox box;
+
+Rule makeRule(RuleAction action, uint8_t priority, int conditionCount, const RuleCondition *conditions)
+{
+  Rule rule = {};
+  rule.action = action;
+  rule.priority = priority;
+  rule.conditionCount = conditionCount;
+  for (int i = 0; i < conditionCount; i++)
+  {
+    rule.conditions[i] = conditions[i];
+  }
+  return rule;
+}
+
+void setUp(void)
+{
+  initRuleEngine(engine);
+  box = {};
+}
+
+void tearDown(void)
+{
+}
+
+//-----------------------
+
+void irrigate(int seconds);
+
+// evaluateRules of the firmware: actions after the pass, the irrigation after the pass ends
+void evaluateRules()
+{
+  RulePass pass;
+  if (box.evaluating || !runRulePass(engine, pass))
+  {
+    return;
+  }
+  box.evaluating = true;
+  for (int i = 0; i < engine.ruleCount; i++)
+  {
+    if (pass.notifications & (1 << i))
+    {
+      box.notifications[i]++;
+    }
+  }
+  box.evaluating = false;
+
+  if (pass.irrigate && !box.irrigating)
+  {
+    irrigate(90);
+  }
+}
+
+// irrigate of the firmware: the pump signal counts the seconds and the rules are evaluated at each one
+void irrigate(int seconds)
+{
+  box.irrigating = true;
+  box.irrigations++;
+  setRuleSignal(engine, SIGNAL_PUMP, 0);
+  for (int second = 1; second <= seconds; second++)
+  {
+    setRuleSignal(engine, SIGNAL_PUMP, second);
+    evaluateRules();
+    if (engine.signalValues[SIGNAL_PUMP] > box.longestPumpSignal)
+    {
+      box.longestPumpSignal = engine.signalValues[SIGNAL_PUMP];
+    }
+  }
+  box.irrigating = false;
+  setRuleSignal(engine, SIGNAL_PUMP, 0);
+}
+
+//-----------------------
+
+void test_conditions_need_known_signals(void)
+{
+  const RuleCondition hot[] = {{SIGNAL_TEMPERATURE, OP_GREATER, 28}, {SIGNAL_LIGHT, OP_EQUAL, 1}};
+  Rule rule = makeRule(ACTION_VENTILATION_ON, 1, 2, hot);
+
+  setRuleSignal(engine, SIGNAL_LIGHT, 1);
+  // No temperature sensor: the condition is never true
+  TEST_ASSERT_FALSE(evaluateRule(engine, rule));
+  setRuleSignal(engine, SIGNAL_TEMPERATURE, 30);
+  TEST_ASSERT_TRUE(evaluateRule(engine, rule));
+  setRuleSignal(engine, SIGNAL_TEMPERATURE, 28);
+  TEST_ASSERT_FALSE(evaluateRule(engine, rule));
+}
+
+//-----------------------
+
+void test_pass_only_reports_changes(void)
+{
+  const RuleCondition dry[] = {{SIGNAL_SOIL, OP_LESS, 40}};
+  TEST_ASSERT_TRUE(appendRule(engine, makeRule(ACTION_NOTIFY, 1, 1, dry)));
+
+  RulePass pass;
+  setRuleSignal(engine, SIGNAL_SOIL, 35);
+  TEST_ASSERT_TRUE(runRulePass(engine, pass));
+  TEST_ASSERT_EQUAL(1, pass.notifications);
+
+  // Same value: nothing to evaluate. Still true: no new notification.
+  setRuleSignal(engine, SIGNAL_SOIL, 35);
+  TEST_ASSERT_FALSE(runRulePass(engine, pass));
+  setRuleSignal(engine, SIGNAL_SOIL, 30);
+  TEST_ASSERT_TRUE(runRulePass(engine, pass));
+  TEST_ASSERT_EQUAL(0, pass.notifications);
+
+  // A signal the rule does not read leaves it alone
+  setRuleSignal(engine, SIGNAL_SOIL, 50);
+  setRuleSignal(engine, SIGNAL_LIGHT, 1);
+  engine.dirtySignals = 1 << SIGNAL_LIGHT;
+  runRulePass(engine, pass);
+  TEST_ASSERT_TRUE(engine.active[0]);
+}
+
+//-----------------------
+
+void test_rule_irrigation_runs_the_pump_rules(void)
+{
+  // hora = 07:00 e solo < 40 -> irrigar ; bomba > 60 -> notificar
+  const RuleCondition morning[] = {{SIGNAL_TIME, OP_EQUAL, 7 * 60}, {SIGNAL_SOIL, OP_LESS, 40}};
+  const RuleCondition longPump[] = {{SIGNAL_PUMP, OP_GREATER, 60}};
+  appendRule(engine, makeRule(ACTION_IRRIGATE, 1, 2, morning));
+  appendRule(engine, makeRule(ACTION_NOTIFY, 1, 1, longPump));
+
+  setRuleSignal(engine, SIGNAL_PUMP, 0);
+  setRuleSignal(engine, SIGNAL_SOIL, 30);
+  setRuleSignal(engine, SIGNAL_TIME, 6 * 60 + 59);
+  evaluateRules();
+  TEST_ASSERT_EQUAL(0, box.irrigations);
+
+  setRuleSignal(engine, SIGNAL_TIME, 7 * 60);
+  evaluateRules();
+  TEST_ASSERT_EQUAL(1, box.irrigations);
+  TEST_ASSERT_EQUAL(90, box.longestPumpSignal);
+  // The pump rule fired during the rule-driven irrigation, once
+  TEST_ASSERT_EQUAL(1, box.notifications[1]);
+
+  // The pump stopped: the pump rule goes back to false and fires again on the next irrigation
+  evaluateRules();
+  TEST_ASSERT_FALSE(engine.active[1]);
+  box.irrigating = false;
+  irrigate(90);
+  TEST_ASSERT_EQUAL(2, box.notifications[1]);
+}
+
+//-----------------------
+
+void test_irrigation_does_not_start_another(void)
+{
+  // Irrigate whenever the pump runs: the rule becomes true during the irrigation and is ignored
+  const RuleCondition pumping[] = {{SIGNAL_PUMP, OP_GREATER, 10}};
+  const RuleCondition dry[] = {{SIGNAL_SOIL, OP_LESS, 40}};
+  appendRule(engine, makeRule(ACTION_IRRIGATE, 1, 1, pumping));
+  appendRule(engine, makeRule(ACTION_IRRIGATE, 1, 1, dry));
+
+  setRuleSignal(engine, SIGNAL_PUMP, 0);
+  setRuleSignal(engine, SIGNAL_SOIL, 30);
+  evaluateRules();
+  TEST_ASSERT_EQUAL(1, box.irrigations);
+}
+
+//-----------------------
+
+void test_actuator_follows_the_highest_priority(void)
+{
+  const RuleCondition hot[] = {{SIGNAL_TEMPERATURE, OP_GREATER, 28}};
+  const RuleCondition night[] = {{SIGNAL_LIGHT, OP_EQUAL, 0}};
+  appendRule(engine, makeRule(ACTION_VENTILATION_ON, 1, 1, hot));
+  appendRule(engine, makeRule(ACTION_VENTILATION_OFF, 2, 1, night));
+  appendRule(engine, makeRule(ACTION_VENTILATION_ON, 2, 1, hot));
+
+  RulePass pass;
+  setRuleSignal(engine, SIGNAL_TEMPERATURE, 30);
+  setRuleSignal(engine, SIGNAL_LIGHT, 1);
+  runRulePass(engine, pass);
+  TEST_ASSERT_TRUE(pass.ventilationChanged);
+  TEST_ASSERT_FALSE(pass.lightChanged);
+  TEST_ASSERT_EQUAL(2, findActuatorRule(engine, ACTION_VENTILATION_ON, ACTION_VENTILATION_OFF));
+
+  // Tie on priority 2: the first one wins
+  setRuleSignal(engine, SIGNAL_LIGHT, 0);
+  runRulePass(engine, pass);
+  TEST_ASSERT_EQUAL(1, findActuatorRule(engine, ACTION_VENTILATION_ON, ACTION_VENTILATION_OFF));
+  TEST_ASSERT_EQUAL(-1, findActuatorRule(engine, ACTION_LIGHT_ON, ACTION_LIGHT_OFF));
+}
+
+//-----------------------
+
+void test_append_and_remove(void)
+{
+  const RuleCondition hot[] = {{SIGNAL_TEMPERATURE, OP_GREATER, 28}};
+  const RuleCondition dry[] = {{SIGNAL_SOIL, OP_LESS, 40}};
+  for (int i = 0; i < MAX_RULES; i++)
+  {
+    TEST_ASSERT_TRUE(appendRule(engine, makeRule(i == 1 ? ACTION_NOTIFY : ACTION_VENTILATION_ON, 1, 1, i == 1 ? dry : hot)));
+  }
+  TEST_ASSERT_FALSE(appendRule(engine, makeRule(ACTION_NOTIFY, 1, 1, dry)));
+  // New rules are evaluated on the next pass even without a signal change
+  TEST_ASSERT_EQUAL((1 << SIGNAL_TEMPERATURE) | (1 << SIGNAL_SOIL), engine.dirtySignals);
+
+  RulePass pass;
+  setRuleSignal(engine, SIGNAL_SOIL, 20);
+  runRulePass(engine, pass);
+  TEST_ASSERT_TRUE(removeRule(engine, 1));
+  TEST_ASSERT_EQUAL(MAX_RULES - 1, engine.ruleCount);
+  TEST_ASSERT_EQUAL(ACTION_VENTILATION_ON, engine.rules[1].action);
+  TEST_ASSERT_FALSE(removeRule(engine, 0));
+  TEST_ASSERT_FALSE(removeRule(engine, MAX_RULES));
+}
+
+//-----------------------
+
+void test_invalid_rules_are_rejected(void)
+{
+  const RuleCondition hot[] = {{SIGNAL_TEMPERATURE, OP_GREATER, 28}};
+  TEST_ASSERT_TRUE(isValidRule(makeRule(ACTION_NOTIFY, 1, 1, hot)));
+  TEST_ASSERT_FALSE(isValidRule(makeRule(ACTION_NOTIFY, 1, 0, hot)));
+  TEST_ASSERT_FALSE(isValidRule(makeRule(ACTION_COUNT, 1, 1, hot)));
+  const RuleCondition unknown[] = {{SIGNAL_COUNT, OP_GREATER, 28}};
+  TEST_ASSERT_FALSE(isValidRule(makeRule(ACTION_NOTIFY, 1, 1, unknown)));
+  // Erased EEPROM
+  Rule erased;
+  memset(&erased, 0xFF, sizeof(erased));
+  TEST_ASSERT_FALSE(isValidRule(erased));
+}
+
+//-----------------------
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_conditions_need_known_signals);
+  RUN_TEST(test_pass_only_reports_changes);
+  RUN_TEST(test_rule_irrigation_runs_the_pump_rules);
+  RUN_TEST(test_irrigation_does_not_start_another);
+  RUN_TEST(test_actuator_follows_the_highest_priority);
+  RUN_TEST(test_append_and_remove);
+  RUN_TEST(test_invalid_rules_are_rejected);
+  return UNITY_END();
+}
@@ -0,0 +1,192 @@
+// Host tests of the loop stage budgets and their one-shot monitor timer (pio test -e native)
+
+#include <unity.h>
+#include <StageMonitor.h>
+#include <LoopStages.h>
+
+// Stage table and watchdog timeout of the firmware, in milliseconds
+#define WATCHDOG_TIMEOUT_MS (WATCHDOG_TIMEOUT * 1000UL)
+
+StageMonitor monitor;
+
+// One-shot timer of the simulation and what its checks saw
+struct SimulatedTimer
+{
+  bool armed;
+  uint32_t due;
+  unsigned long fired;
+  unsigned long overruns;
+  uint32_t overrunTime;
+  uint32_t stallElapsed;
+};
+
+SimulatedTimer timer;
+uint32_t now;
+
+void setUp(void)
+{
+  initStageMonitor(monitor, stageBudgets, STAGE_COUNT, WATCHDOG_TIMEOUT_MS);
+  timer = {};
+  now = 0xFFFFFFFFUL - 60000;
+}
+
+void tearDown(void)
+{
+}
+
+//-----------------------
+
+// beginStage of the firmware: restart the stage and re-arm the timer at the end of its budget
+bool beginStage(int stage)
+{
+  bool endedLate = beginMonitoredStage(monitor, stage, now);
+  timer.armed = true;
+  timer.due = now + getStageBudget(monitor, stage) + 1;
+  return endedLate;
+}
+
+// Let time pass, firing the timer callback (checkStageBudget) when it is due
+void advance(uint32_t milliseconds)
+{
+  uint32_t end = now + milliseconds;
+  while (timer.armed && (int32_t)(end - timer.due) >= 0)
+  {
+    now = timer.due;
+    timer.fired++;
+    uint32_t nextCheck;
+    StageCheck check = checkMonitoredStage(monitor, now, nextCheck);
+    if (check == STAGE_OVERRUN)
+    {
+      timer.overruns++;
+      timer.overrunTime = now - monitor.start;
+    }
+    if (check != STAGE_ON_TIME)
+    {
+      timer.stallElapsed = now - monitor.start;
+    }
+    timer.due = now + nextCheck;
+  }
+  now = end;
+}
+
+//-----------------------
+
+void test_budgets_stay_below_the_watchdog(void)
+{
+  for (int stage = 0; stage < STAGE_COUNT; stage++)
+  {
+    TEST_ASSERT_EQUAL_UINT32(stageBudgets[stage], getStageBudget(monitor, stage));
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(WATCHDOG_TIMEOUT_MS - STAGE_WATCHDOG_MARGIN, getStageBudget(monitor, stage));
+  }
+
+  // The idle stage never sleeps longer than MAX_IDLE_TIME: its budget must cover a full wait
+  TEST_ASSERT_GREATER_THAN(MAX_IDLE_TIME, getStageBudget(monitor, STAGE_IDLE));
+
+  // A budget past the watchdog is clamped, so the stall is recorded before the reset
+  const uint32_t longBudgets[] = {90000, 1000};
+  initStageMonitor(monitor, longBudgets, 2, WATCHDOG_TIMEOUT_MS);
+  TEST_ASSERT_EQUAL_UINT32(WATCHDOG_TIMEOUT_MS - STAGE_WATCHDOG_MARGIN, getStageBudget(monitor, 0));
+  TEST_ASSERT_EQUAL_UINT32(1000, getStageBudget(monitor, 1));
+}
+
+//-----------------------
+
+void test_check_inside_the_budget(void)
+{
+  beginStage(STAGE_LIGHT);
+  uint32_t nextCheck;
+  uint32_t budget = stageBudgets[STAGE_LIGHT];
+  TEST_ASSERT_EQUAL(STAGE_ON_TIME, checkMonitoredStage(monitor, now + 4000, nextCheck));
+  TEST_ASSERT_EQUAL_UINT32(budget - 4000 + 1, nextCheck);
+  TEST_ASSERT_EQUAL(STAGE_ON_TIME, checkMonitoredStage(monitor, now + budget, nextCheck));
+  TEST_ASSERT_EQUAL_UINT32(1, nextCheck);
+}
+
+//-----------------------
+
+void test_overrun_is_reported_once(void)
+{
+  beginStage(STAGE_RULES);
+  uint32_t nextCheck;
+  uint32_t budget = stageBudgets[STAGE_RULES];
+  TEST_ASSERT_EQUAL(STAGE_OVERRUN, checkMonitoredStage(monitor, now + budget + 1, nextCheck));
+  TEST_ASSERT_EQUAL_UINT32(STALL_UPDATE_PERIOD, nextCheck);
+  TEST_ASSERT_EQUAL(STAGE_STILL_OVERRUN, checkMonitoredStage(monitor, now + budget + 1 + STALL_UPDATE_PERIOD, nextCheck));
+  // The stage ended late: the next one reports it, and starts clean
+  TEST_ASSERT_TRUE(beginStage(STAGE_OTA));
+  TEST_ASSERT_FALSE(beginStage(STAGE_IDLE));
+}
+
+//-----------------------
+
+void test_loop_on_time_never_wakes_the_monitor(void)
+{
+  // One hour of loop passes inside their budgets: the one-shot timer never fires
+  for (int pass = 0; pass < ONE_HOUR / MAX_IDLE_TIME; pass++)
+  {
+    for (int stage = STAGE_COMMANDS; stage <= STAGE_OTA; stage++)
+    {
+      beginStage(stage);
+      advance(50);
+    }
+    beginStage(STAGE_IDLE);
+    advance(MAX_IDLE_TIME - 250);
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, timer.fired);
+  TEST_ASSERT_EQUAL_UINT32(0, timer.overruns);
+}
+
+//-----------------------
+
+void test_hung_stage_is_caught_before_the_watchdog(void)
+{
+  beginStage(STAGE_COMMANDS);
+  // A TLS read that never returns: only the watchdog ends it
+  advance(WATCHDOG_TIMEOUT_MS);
+  TEST_ASSERT_EQUAL_UINT32(1, timer.overruns);
+  TEST_ASSERT_EQUAL_UINT32(stageBudgets[STAGE_COMMANDS] + 1, timer.overrunTime);
+  // The stall length was kept up to date until the reset
+  TEST_ASSERT_GREATER_OR_EQUAL(WATCHDOG_TIMEOUT_MS - STALL_UPDATE_PERIOD, timer.stallElapsed);
+  // One wake for the budget, then one per STALL_UPDATE_PERIOD
+  TEST_ASSERT_EQUAL_UINT32(1 + (WATCHDOG_TIMEOUT_MS - stageBudgets[STAGE_COMMANDS] - 1) / STALL_UPDATE_PERIOD, timer.fired);
+}
+
+//-----------------------
+
+void test_long_irrigation_stays_inside_the_pump_stage(void)
+{
+  // 255 s irrigation (the longest the EEPROM byte holds) in 1 s steps, each restarting the pump stage
+  beginStage(STAGE_COMMANDS);
+  advance(100);
+  int previousStage = monitor.stage;
+  beginStage(STAGE_PUMP);
+  for (int second = 0; second < 255; second++)
+  {
+    advance(1000);
+    beginStage(STAGE_PUMP);
+    // Rules evaluated at each step, one of them sending a notification
+    advance(second == 100 ? 8000 : 20);
+  }
+  TEST_ASSERT_FALSE(beginStage(previousStage));
+  TEST_ASSERT_EQUAL_UINT32(0, timer.overruns);
+
+  // A step that hangs turns the pump off within the pump budget
+  beginStage(STAGE_PUMP);
+  advance(WATCHDOG_TIMEOUT_MS);
+  TEST_ASSERT_EQUAL_UINT32(1, timer.overruns);
+  TEST_ASSERT_EQUAL_UINT32(stageBudgets[STAGE_PUMP] + 1, timer.overrunTime);
+}
+
+//-----------------------
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_budgets_stay_below_the_watchdog);
+  RUN_TEST(test_check_inside_the_budget);
+  RUN_TEST(test_overrun_is_reported_once);
+  RUN_TEST(test_loop_on_time_never_wakes_the_monitor);
+  RUN_TEST(test_hung_stage_is_caught_before_the_watchdog);
+  RUN_TEST(test_long_irrigation_stays_inside_the_pump_stage);
+  return UNITY_END();
+}